@@ -0,0 +1,350 @@
+/**
+@file
+Modbus RTU frame codec shared by ModbusMaster and ModbusSlave.
+*/
+/*
+
+  ModbusCodec.cpp - Modbus RTU frame codec shared by ModbusMaster and
+  ModbusSlave.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusCodec.h"
+#if defined(__AVR__)
+// functions to calculate Modbus Application Data Unit CRC
+#include <util/crc16.h>
+#include <avr/pgmspace.h>
+#define MB_PROGMEM PROGMEM
+#define MB_READ_TABLE(p) pgm_read_word(p)
+#else
+#define MB_PROGMEM
+#define MB_READ_TABLE(p) (*(p))
+#endif
+
+
+/* _____UTILITY MACROS_______________________________________________________ */
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
+
+/* _____GLOBAL VARIABLES_____________________________________________________ */
+#if __MODBUSMASTER_CRC_TABLE__
+/// CRC of each byte value, reflected polynomial 0xA001
+static const uint16_t MBCRCTable[256] MB_PROGMEM =
+{
+  0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+  0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+  0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+  0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+  0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+  0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+  0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+  0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+  0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+  0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+  0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+  0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+  0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+  0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+  0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+  0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+  0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+  0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+  0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+  0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+  0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+  0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+  0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+  0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+  0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+  0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+  0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+  0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+  0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+  0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+  0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+  0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
+#endif
+
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+/**
+Calculate the CRC of a Modbus RTU frame.
+
+Shared by ModbusMaster and ModbusSlave so both ends of a link use the 
+same codec. Uses the avr-libc CRC routine on AVR and the equivalent 
+bitwise loop (reflected polynomial 0xA001) elsewhere.
+
+@param pu8ADU frame, starting with the slave ID
+@param u8Size quantity of bytes to include, excluding the CRC itself
+@return CRC; transmitted low byte first
+@ingroup buffer
+*/
+uint16_t ModbusCodec::calculateCRC(const uint8_t *pu8ADU, uint8_t u8Size)
+{
+  uint16_t u16CRC = 0xFFFF;
+  uint8_t i;
+  
+  for (i = 0; i < u8Size; i++)
+  {
+#if __MODBUSMASTER_CRC_TABLE__
+    u16CRC = (u16CRC >> 8) ^ MB_READ_TABLE(&MBCRCTable[(u16CRC ^ pu8ADU[i]) & 0xFF]);
+#elif defined(__AVR__)
+    u16CRC = _crc16_update(u16CRC, pu8ADU[i]);
+#else
+    uint8_t j;
+    
+    u16CRC ^= pu8ADU[i];
+    for (j = 0; j < 8; j++)
+    {
+      u16CRC = (u16CRC & 1) ? (u16CRC >> 1) ^ 0xA001 : u16CRC >> 1;
+    }
+#endif
+  }
+  return u16CRC;
+}
+
+
+/**
+Constructor.
+
+Creates a bit set over caller-supplied storage of at least 
+(u16Size + 7) / 8 bytes. The storage is not cleared.
+
+@param pu8Bits bit storage
+@param u16Size number of bits (1..2000)
+@ingroup bitset
+*/
+ModbusBitSet::ModbusBitSet(uint8_t *pu8Bits, uint16_t u16Size)
+{
+  _pu8Bits = pu8Bits;
+  _u16Size = u16Size;
+}
+
+
+/**
+Number of bits in the bit set.
+
+@return number of bits
+@ingroup bitset
+*/
+uint16_t ModbusBitSet::size()
+{
+  return _u16Size;
+}
+
+
+/**
+Bit storage in Modbus frame byte layout.
+
+@return pointer to the first byte
+@ingroup bitset
+*/
+uint8_t *ModbusBitSet::data()
+{
+  return _pu8Bits;
+}
+
+
+/**
+Retrieve a single bit.
+
+@param u16Index bit index (0..size() - 1)
+@return 1 if set, 0 if clear or out of range
+@ingroup bitset
+*/
+uint8_t ModbusBitSet::getBit(uint16_t u16Index)
+{
+  if (u16Index >= _u16Size)
+  {
+    return 0;
+  }
+  return (_pu8Bits[u16Index >> 3] >> (u16Index & 7)) & 1;
+}
+
+
+/**
+Set or clear a single bit.
+
+@param u16Index bit index (0..size() - 1)
+@param u8State 0=clear, non-zero=set
+@ingroup bitset
+*/
+void ModbusBitSet::setBit(uint16_t u16Index, uint8_t u8State)
+{
+  if (u16Index >= _u16Size)
+  {
+    return;
+  }
+  if (u8State)
+  {
+    _pu8Bits[u16Index >> 3] |= 1 << (u16Index & 7);
+  }
+  else
+  {
+    _pu8Bits[u16Index >> 3] &= ~(1 << (u16Index & 7));
+  }
+}
+
+
+/**
+Clear all bits.
+
+@ingroup bitset
+*/
+void ModbusBitSet::clearAll()
+{
+  memset(_pu8Bits, 0, (_u16Size + 7) >> 3);
+}
+
+
+/**
+Copy bits from another bit set.
+
+Copies as many bits as both sets hold.
+
+@param bsOther source bit set
+@ingroup bitset
+*/
+void ModbusBitSet::copy(ModbusBitSet &bsOther)
+{
+  memcpy(_pu8Bits, bsOther._pu8Bits, (min(_u16Size, bsOther._u16Size) + 7) >> 3);
+}
+
+
+/**
+Count set bits.
+
+@return number of bits set
+@ingroup bitset
+*/
+uint16_t ModbusBitSet::countSet()
+{
+  uint16_t i;
+  uint16_t u16Count = 0;
+  uint32_t u32Chunk;
+  
+  for (i = 0; i < ((_u16Size + 31) >> 5); i++)
+  {
+    u32Chunk = loadChunk(i);
+    if (32 * (i + 1) > _u16Size)
+    {
+      // ignore padding bits past the last bit
+      u32Chunk &= (1UL << (_u16Size & 31)) - 1;
+    }
+    u16Count += __builtin_popcountl(u32Chunk);
+  }
+  return u16Count;
+}
+
+
+/**
+Compute the bits that differ from another bit set.
+
+Sets bsChanged to this XOR bsOther over the bits all three sets hold, 
+32 bits at a time.
+
+@param bsOther bit set to compare with (e.g. the previous scan)
+@param bsChanged destination for the changed-bit mask
+@return number of changed bits
+@ingroup bitset
+*/
+uint16_t ModbusBitSet::diff(ModbusBitSet &bsOther, ModbusBitSet &bsChanged)
+{
+  uint16_t i, u16Size, u16Bytes;
+  uint16_t u16Count = 0;
+  uint32_t u32Changed;
+  
+  u16Size = min(min(_u16Size, bsOther._u16Size), bsChanged._u16Size);
+  u16Bytes = (u16Size + 7) >> 3;
+  for (i = 0; 4 * i < u16Bytes; i++)
+  {
+    u32Changed = loadChunk(i) ^ bsOther.loadChunk(i);
+    if (32 * (i + 1) > u16Size)
+    {
+      // ignore padding bits past the last bit compared
+      u32Changed &= (1UL << (u16Size & 31)) - 1;
+    }
+    memcpy(&bsChanged._pu8Bits[4 * i], &u32Changed, min(4, u16Bytes - 4 * i));
+    u16Count += __builtin_popcountl(u32Changed);
+  }
+  return u16Count;
+}
+
+
+/**
+Find the next bit that differs from another bit set.
+
+Skips unchanged bits 32 at a time, so walking all changes costs one 
+step per 32 bits plus one per change:
+
+@code
+for (i = bs.findChanged(old, 0); i < bs.size(); i = bs.findChanged(old, i + 1))
+@endcode
+
+@param bsOther bit set to compare with (e.g. the previous scan)
+@param u16Start first bit index to examine
+@return index of the first differing bit at or after u16Start; size() if none
+@ingroup bitset
+*/
+uint16_t ModbusBitSet::findChanged(ModbusBitSet &bsOther, uint16_t u16Start)
+{
+  uint16_t i, u16Size;
+  uint32_t u32Changed;
+  
+  u16Size = min(_u16Size, bsOther._u16Size);
+  for (i = u16Start >> 5; i < ((u16Size + 31) >> 5); i++)
+  {
+    u32Changed = loadChunk(i) ^ bsOther.loadChunk(i);
+    if (i == (u16Start >> 5))
+    {
+      // ignore bits below the start index
+      u32Changed &= 0xFFFFFFFFUL << (u16Start & 31);
+    }
+    if (u32Changed)
+    {
+      i = 32 * i + __builtin_ctzl(u32Changed);
+      return (i < u16Size) ? i : _u16Size;
+    }
+  }
+  return _u16Size;
+}
+
+
+/**
+Load 32 bits of the bit set as a word.
+
+@param u16Chunk chunk index (bits 32 * u16Chunk..32 * u16Chunk + 31)
+@return bits of the chunk; bits beyond the storage read as 0
+*/
+uint32_t ModbusBitSet::loadChunk(uint16_t u16Chunk)
+{
+  uint32_t u32Chunk = 0;
+  uint16_t u16Bytes = (_u16Size + 7) >> 3;
+  
+  memcpy(&u32Chunk, &_pu8Bits[4 * u16Chunk], min(4, u16Bytes - 4 * u16Chunk));
+  return u32Chunk;
+}
@@ -0,0 +1,352 @@
+/**
+@file
+Modbus RTU frame codec shared by ModbusMaster and ModbusSlave: function 
+codes, exception codes, CRC and coil bit sets.
+
+Depends on the C standard library only, so it builds for the host as 
+well as for the target.
+*/
+/*
+
+  ModbusCodec.h - Modbus RTU frame codec shared by ModbusMaster and
+  ModbusSlave.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+
+#ifndef ModbusCodec_h
+#define ModbusCodec_h
+
+
+/**
+@def __MODBUSMASTER_CRC_TABLE__ (0)
+Set to 1 to calculate CRCs from a 512-byte table (in program memory on 
+AVR) instead of bit by bit.
+*/
+#ifndef __MODBUSMASTER_CRC_TABLE__
+#define __MODBUSMASTER_CRC_TABLE__ (0)
+#endif
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+#include <stdint.h>
+#include <string.h>
+
+
+/* _____UTILITY MACROS_______________________________________________________ */
+#ifndef ARDUINO
+/**
+@def lowByte(w) ((uint8_t) ((w) & 0xFF))
+Macro to return low byte of a 16-bit integer (Wiring core API).
+*/
+#define lowByte(w) ((uint8_t) ((w) & 0xFF))
+
+
+/**
+@def highByte(w) ((uint8_t) ((w) >> 8))
+Macro to return high byte of a 16-bit integer (Wiring core API).
+*/
+#define highByte(w) ((uint8_t) ((w) >> 8))
+
+
+/**
+Generate a 16-bit integer from two bytes (Wiring core API).
+
+@param u8High high byte
+@param u8Low low byte
+@return word
+*/
+static inline uint16_t word(uint8_t u8High, uint8_t u8Low)
+{
+  return ((uint16_t) u8High << 8) | u8Low;
+}
+#endif
+
+
+/* _____TYPE DEFINITIONS_____________________________________________________ */
+/**
+Callback driving an RS-485 transceiver's direction, e.g. through a port 
+expander. Called before the first and after the last bit of a frame.
+
+@ingroup setup
+*/
+typedef void (*MBDirectionCallback)();
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Coil/discrete input bit set.
+
+Bits are stored exactly as they travel in a Modbus frame: bit n is bit 
+(n % 8) of byte (n / 8), so coils move between frame and bit set with a 
+single copy. Bulk operations work on 32 bits at a time (the byte layout 
+matches a little-endian 32-bit word, as on AVR and ARM).
+
+Storage is supplied by the caller; see ModbusCoils for a bit set that 
+carries its own.
+
+@ingroup bitset
+*/
+class ModbusBitSet
+{
+  public:
+    ModbusBitSet(uint8_t *, uint16_t);
+    
+    uint16_t size();
+    uint8_t *data();
+    uint8_t  getBit(uint16_t);
+    void     setBit(uint16_t, uint8_t);
+    void     clearAll();
+    void     copy(ModbusBitSet &);
+    uint16_t countSet();
+    uint16_t diff(ModbusBitSet &, ModbusBitSet &);
+    uint16_t findChanged(ModbusBitSet &, uint16_t);
+    
+  private:
+    uint8_t  *_pu8Bits;                                          ///< bit storage, frame byte layout
+    uint16_t _u16Size;                                           ///< number of bits
+    
+    uint32_t loadChunk(uint16_t);
+};
+
+
+/**
+Bit set with built-in storage for u16Bits coils/discrete inputs 
+(1..2000, the most a single read request can return).
+
+@ingroup bitset
+*/
+template <uint16_t u16Bits>
+class ModbusCoils : public ModbusBitSet
+{
+  public:
+    ModbusCoils() : ModbusBitSet(_u8Storage, u16Bits)
+    {
+      clearAll();
+    }
+    
+  private:
+    uint8_t _u8Storage[(u16Bits + 7) >> 3];                      ///< bit storage, frame byte layout
+};
+
+
+/**
+Modbus RTU frame codec.
+
+Function codes, exception codes and the CRC used by both ends of a link; 
+ModbusMaster derives from it, ModbusSlave refers to it directly.
+*/
+class ModbusCodec
+{
+  public:
+    // Modbus exception codes
+    /**
+    Modbus protocol illegal function exception.
+    
+    The function code received in the query is not an allowable action for
+    the server (or slave). This may be because the function code is only
+    applicable to newer devices, and was not implemented in the unit
+    selected. It could also indicate that the server (or slave) is in the
+    wrong state to process a request of this type, for example because it is
+    unconfigured and is being asked to return register values.
+    
+    @ingroup constant
+    */
+    static const uint8_t ku8MBIllegalFunction            = 0x01;
+
+    /**
+    Modbus protocol illegal data address exception.
+    
+    The data address received in the query is not an allowable address for 
+    the server (or slave). More specifically, the combination of reference 
+    number and transfer length is invalid. For a controller with 100 
+    registers, the ADU addresses the first register as 0, and the last one 
+    as 99. If a request is submitted with a starting register address of 96 
+    and a quantity of registers of 4, then this request will successfully 
+    operate (address-wise at least) on registers 96, 97, 98, 99. If a 
+    request is submitted with a starting register address of 96 and a 
+    quantity of registers of 5, then this request will fail with Exception 
+    Code 0x02 "Illegal Data Address" since it attempts to operate on 
+    registers 96, 97, 98, 99 and 100, and there is no register with address 
+    100. 
+    
+    @ingroup constant
+    */
+    static const uint8_t ku8MBIllegalDataAddress         = 0x02;
+    
+    /**
+    Modbus protocol illegal data value exception.
+    
+    A value contained in the query data field is not an allowable value for 
+    server (or slave). This indicates a fault in the structure of the 
+    remainder of a complex request, such as that the implied length is 
+    incorrect. It specifically does NOT mean that a data item submitted for 
+    storage in a register has a value outside the expectation of the 
+    application program, since the MODBUS protocol is unaware of the 
+    significance of any particular value of any particular register.
+    
+    @ingroup constant
+    */
+    static const uint8_t ku8MBIllegalDataValue           = 0x03;
+    
+    /**
+    Modbus protocol slave device failure exception.
+    
+    An unrecoverable error occurred while the server (or slave) was
+    attempting to perform the requested action.
+    
+    @ingroup constant
+    */
+    static const uint8_t ku8MBSlaveDeviceFailure         = 0x04;
+
+    // Class-defined success code
+    /**
+    Modbus success.
+    
+    Modbus transaction was successful; the following checks were valid:
+      - slave ID
+      - function code
+      - response code
+      - data
+      - CRC
+      
+    @ingroup constant
+    */
+    static const uint8_t ku8MBSuccess                    = 0x00;
+    
+    // Modbus function 0x08 Diagnostics sub-function codes
+    /**
+    Diagnostics sub-function 0x0000 Return Query Data.
+
+    The data passed in the request data field is to be returned (looped
+    back) in the response. The entire response message should be identical
+    to the request.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBReturnQueryData          = 0x0000;
+
+    /**
+    Diagnostics sub-function 0x000A Clear Counters and Diagnostic Register.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBClearCounters            = 0x000A;
+
+    /**
+    Diagnostics sub-function 0x000B Return Bus Message Count.
+
+    The response data field returns the quantity of messages that the
+    remote device has detected on the communications system since its last
+    restart, clear counters operation, or power-up.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBReturnBusMessageCount    = 0x000B;
+
+    /**
+    Diagnostics sub-function 0x000C Return Bus Communication Error Count.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBReturnBusCommErrorCount  = 0x000C;
+
+    /**
+    Diagnostics sub-function 0x000D Return Bus Exception Error Count.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBReturnBusExceptionCount  = 0x000D;
+
+    /**
+    Diagnostics sub-function 0x000E Return Slave Message Count.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBReturnSlaveMessageCount  = 0x000E;
+
+    /**
+    Diagnostics sub-function 0x000F Return Slave No Response Count.
+
+    @ingroup diagnostic
+    */
+    static const uint16_t ku16MBReturnSlaveNoRespCount   = 0x000F;
+
+    // Modbus function 0x2B/0x0E Read Device Identification access codes
+    /**
+    Read Device Identification code 0x01: request to get the basic device
+    identification (stream access).
+
+    @ingroup diagnostic
+    */
+    static const uint8_t ku8MBDeviceIdBasic              = 0x01;
+
+    /**
+    Read Device Identification code 0x02: request to get the regular device
+    identification (stream access).
+
+    @ingroup diagnostic
+    */
+    static const uint8_t ku8MBDeviceIdRegular            = 0x02;
+
+    /**
+    Read Device Identification code 0x03: request to get the extended
+    device identification (stream access).
+
+    @ingroup diagnostic
+    */
+    static const uint8_t ku8MBDeviceIdExtended           = 0x03;
+
+    /**
+    Read Device Identification code 0x04: request to get one specific
+    identification object (individual access).
+
+    @ingroup diagnostic
+    */
+    static const uint8_t ku8MBDeviceIdSpecific           = 0x04;
+
+    // Modbus function codes for bit access
+    static const uint8_t ku8MBReadCoils                  = 0x01; ///< Modbus function 0x01 Read Coils
+    static const uint8_t ku8MBReadDiscreteInputs         = 0x02; ///< Modbus function 0x02 Read Discrete Inputs
+    static const uint8_t ku8MBWriteSingleCoil            = 0x05; ///< Modbus function 0x05 Write Single Coil
+    static const uint8_t ku8MBWriteMultipleCoils         = 0x0F; ///< Modbus function 0x0F Write Multiple Coils
+
+    // Modbus function codes for 16 bit access
+    static const uint8_t ku8MBReadHoldingRegisters       = 0x03; ///< Modbus function 0x03 Read Holding Registers
+    static const uint8_t ku8MBReadInputRegisters         = 0x04; ///< Modbus function 0x04 Read Input Registers
+    static const uint8_t ku8MBWriteSingleRegister        = 0x06; ///< Modbus function 0x06 Write Single Register
+    static const uint8_t ku8MBWriteMultipleRegisters     = 0x10; ///< Modbus function 0x10 Write Multiple Registers
+    static const uint8_t ku8MBMaskWriteRegister          = 0x16; ///< Modbus function 0x16 Mask Write Register
+    static const uint8_t ku8MBReadWriteMultipleRegisters = 0x17; ///< Modbus function 0x17 Read Write Multiple Registers
+    
+    // Modbus function codes for diagnostics
+    static const uint8_t ku8MBDiagnostics                = 0x08; ///< Modbus function 0x08 Diagnostics (serial line only)
+    static const uint8_t ku8MBEncapsulatedInterface      = 0x2B; ///< Modbus function 0x2B Encapsulated Interface Transport
+    static const uint8_t ku8MBReadDeviceIdentification   = 0x0E; ///< MEI type 0x0E Read Device Identification (function 0x2B)
+    
+    // Modbus function codes for file record access
+    static const uint8_t ku8MBReadFileRecord             = 0x14; ///< Modbus function 0x14 Read File Record
+    static const uint8_t ku8MBWriteFileRecord            = 0x15; ///< Modbus function 0x15 Write File Record
+    static const uint8_t ku8MBReadFifoQueue              = 0x18; ///< Modbus function 0x18 Read FIFO Queue
+    
+    static uint16_t calculateCRC(const uint8_t *, uint8_t);
+};
+#endif
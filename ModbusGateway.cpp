@@ -0,0 +1,761 @@
+/**
+@file
+Modbus TCP to RTU gateway with request merging and a read cache.
+*/
+/*
+
+  ModbusGateway.cpp - Modbus TCP to RTU gateway with request merging
+  and a read cache.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusGateway.h"
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+/**
+Constructor.
+
+Creates a gateway forwarding to the given RTU bus. Entries must be
+supplied with setEntries() before requests can be forwarded.
+
+@param mbBus RTU bus; must not be polled by anyone else
+@ingroup gateway
+*/
+ModbusGateway::ModbusGateway(ModbusMaster &mbBus)
+{
+  uint8_t i;
+  
+  _pBus = &mbBus;
+  _pEntries = 0;
+  _u8EntryCount = 0;
+  _u16CacheTime = 0;
+  for (i = 0; i < ku8MBGatewayMaxClients; i++)
+  {
+    _pClient[i] = 0;
+    _u8HeaderSize[i] = 0;
+    _u8Waiting[i] = ku8MBNoEntry;
+  }
+  clearStats();
+}
+
+
+/**
+Supply the request/cache entries.
+
+Each entry holds one RTU request in flight or one cached read; with
+fewer entries than clients, requests are refused with
+ku8MBSlaveDeviceBusy while all entries are in use.
+
+@param pEntries entry storage
+@param u8Count number of entries (0..254)
+@ingroup gateway
+*/
+void ModbusGateway::setEntries(ModbusGatewayEntry *pEntries, uint8_t u8Count)
+{
+  uint8_t i;
+  
+  _pEntries = pEntries;
+  _u8EntryCount = pEntries ? min(u8Count, ku8MBNoEntry - 1) : 0;
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    _pEntries[i].u8State = ku8MBEntryFree;
+    _pEntries[i].u8Waiters = 0;
+    _pEntries[i].request.u8Status = ModbusMaster::ku8MBSuccess;
+  }
+}
+
+
+/**
+Set the time a completed read answers other reads it covers.
+
+@param u16CacheTime cache time [milliseconds] (0 = no cache, default);
+reads still merge with queued requests
+@ingroup gateway
+*/
+void ModbusGateway::setCacheTime(uint16_t u16CacheTime)
+{
+  _u16CacheTime = u16CacheTime;
+}
+
+
+/**
+Serve a TCP connection.
+
+The connection is served until it closes or removeClient() is called.
+
+@param client connected client
+@return 0 on success; ku8MBSlaveDeviceBusy if all client slots are in use
+@ingroup gateway
+*/
+uint8_t ModbusGateway::addClient(Client &client)
+{
+  uint8_t i;
+  
+  for (i = 0; i < ku8MBGatewayMaxClients; i++)
+  {
+    if (_pClient[i] == &client)
+    {
+      return ModbusMaster::ku8MBSuccess;
+    }
+  }
+  for (i = 0; i < ku8MBGatewayMaxClients; i++)
+  {
+    if (!_pClient[i])
+    {
+      _pClient[i] = &client;
+      _u8HeaderSize[i] = 0;
+      _u8Waiting[i] = ku8MBNoEntry;
+      return ModbusMaster::ku8MBSuccess;
+    }
+  }
+  return ku8MBSlaveDeviceBusy;
+}
+
+
+/**
+Stop serving a TCP connection.
+
+A pending response for the connection is discarded; the connection
+itself is left open.
+
+@param client client passed to addClient()
+@ingroup gateway
+*/
+void ModbusGateway::removeClient(Client &client)
+{
+  uint8_t i;
+  
+  for (i = 0; i < ku8MBGatewayMaxClients; i++)
+  {
+    if (_pClient[i] == &client)
+    {
+      drop(i);
+    }
+  }
+}
+
+
+/**
+Serve clients and the RTU bus.
+
+Receives at most one request from each client, executes one queued RTU
+request (blocking for its round trip), answers every client whose
+request has completed and retires expired cache entries. Call
+repeatedly from loop().
+
+@ingroup gateway
+*/
+void ModbusGateway::poll()
+{
+  ModbusGatewayEntry *pEntry;
+  uint8_t i;
+  
+  for (i = 0; i < ku8MBGatewayMaxClients; i++)
+  {
+    receive(i);
+  }
+  
+  _pBus->poll();
+  
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    pEntry = &_pEntries[i];
+    if (pEntry->u8State == ku8MBEntryQueued &&
+      pEntry->request.u8Status != ModbusMaster::ku8MBRequestPending)
+    {
+      pEntry->u8State = ku8MBEntryComplete;
+      pEntry->u32Time = millis();
+      
+      // reads queued before a write may have cached the old values
+      if (pEntry->request.u8MBFunction > ModbusMaster::ku8MBReadInputRegisters)
+      {
+        expire(pEntry->request.u8MBSlave);
+      }
+    }
+  }
+  
+  for (i = 0; i < ku8MBGatewayMaxClients; i++)
+  {
+    if (_u8Waiting[i] != ku8MBNoEntry &&
+      _pEntries[_u8Waiting[i]].u8State == ku8MBEntryComplete)
+    {
+      respond(i);
+    }
+  }
+  
+  // keep successful reads until they expire; free everything else
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    pEntry = &_pEntries[i];
+    if (pEntry->u8State == ku8MBEntryComplete && !pEntry->u8Waiters &&
+      (pEntry->request.u8Status != ModbusMaster::ku8MBSuccess ||
+      pEntry->request.u8MBFunction > ModbusMaster::ku8MBReadInputRegisters ||
+      millis() - pEntry->u32Time >= _u16CacheTime))
+    {
+      pEntry->u8State = ku8MBEntryFree;
+    }
+  }
+}
+
+
+/**
+Retrieve gateway statistics.
+
+@param pStats destination
+@ingroup gateway
+*/
+void ModbusGateway::getStats(ModbusGatewayStats *pStats)
+{
+  *pStats = _Stats;
+}
+
+
+/**
+Clear gateway statistics.
+
+@ingroup gateway
+*/
+void ModbusGateway::clearStats()
+{
+  memset(&_Stats, 0, sizeof(_Stats));
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Receive the next request of a client, if complete.
+
+The MBAP header is collected as it arrives; the PDU is read once all of
+it is available. Nothing is read while the client waits for a response.
+A connection that closes or sends a malformed header is dropped.
+
+@param u8Client client slot
+*/
+void ModbusGateway::receive(uint8_t u8Client)
+{
+  Client *pClient = _pClient[u8Client];
+  uint8_t *pu8Header = _u8Header[u8Client];
+  uint16_t u16Length;
+  uint8_t i;
+  
+  if (!pClient)
+  {
+    return;
+  }
+  if (!pClient->connected())
+  {
+    drop(u8Client);
+    return;
+  }
+  if (_u8Waiting[u8Client] != ku8MBNoEntry)
+  {
+    return;
+  }
+  
+  while (_u8HeaderSize[u8Client] < 7 && pClient->available())
+  {
+    pu8Header[_u8HeaderSize[u8Client]++] = pClient->read();
+  }
+  if (_u8HeaderSize[u8Client] < 7)
+  {
+    return;
+  }
+  
+  // protocol identifier 0; length covers unit identifier and PDU
+  u16Length = word(pu8Header[4], pu8Header[5]);
+  if (word(pu8Header[2], pu8Header[3]) || u16Length < 2 || u16Length > 254)
+  {
+    pClient->stop();
+    drop(u8Client);
+    return;
+  }
+  if (pClient->available() < (int) u16Length - 1)
+  {
+    return;
+  }
+  
+  memcpy(_u8Frame, pu8Header, 7);
+  for (i = 0; i < u16Length - 1; i++)
+  {
+    _u8Frame[7 + i] = pClient->read();
+  }
+  _u8HeaderSize[u8Client] = 0;
+  _Stats.u32Requests++;
+  handle(u8Client, u16Length - 1);
+}
+
+
+/**
+Handle a request PDU received from a client.
+
+Validates the request, then answers it from the cache, merges it with a
+queued request or forwards it to the bus.
+
+@param u8Client client slot
+@param u8Size size of the PDU in _u8Frame[7..] [bytes]
+*/
+void ModbusGateway::handle(uint8_t u8Client, uint8_t u8Size)
+{
+  uint8_t *pu8PDU = &_u8Frame[7];
+  uint8_t u8MBFunction = pu8PDU[0];
+  uint16_t u16Qty = word(pu8PDU[3], pu8PDU[4]);
+  uint8_t u8MBStatus;
+  
+  switch(u8MBFunction)
+  {
+    case ModbusMaster::ku8MBReadCoils:
+    case ModbusMaster::ku8MBReadDiscreteInputs:
+    case ModbusMaster::ku8MBReadHoldingRegisters:
+    case ModbusMaster::ku8MBReadInputRegisters:
+      if (u8Size != 5 || !u16Qty || u16Qty > ((u8MBFunction <= ModbusMaster::ku8MBReadDiscreteInputs) ?
+        ku8MBGatewayMaxWords << 4 : ku8MBGatewayMaxWords))
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      _u16Address[u8Client] = word(pu8PDU[1], pu8PDU[2]);
+      _u16Qty[u8Client] = u16Qty;
+      u8MBStatus = merge(u8Client, _u8Frame[6], u8MBFunction);
+      if (u8MBStatus == ku8MBNoEntry)
+      {
+        u8MBStatus = forward(u8Client, u8Size);
+      }
+      break;
+    
+    case ModbusMaster::ku8MBWriteSingleCoil:
+    case ModbusMaster::ku8MBWriteSingleRegister:
+    case ModbusMaster::ku8MBWriteMultipleCoils:
+    case ModbusMaster::ku8MBWriteMultipleRegisters:
+    case ModbusMaster::ku8MBMaskWriteRegister:
+    case ModbusMaster::ku8MBReadWriteMultipleRegisters:
+      u8MBStatus = forward(u8Client, u8Size);
+      break;
+    
+    default:
+      u8MBStatus = ModbusMaster::ku8MBIllegalFunction;
+      break;
+  }
+  
+  if (u8MBStatus)
+  {
+    _Stats.u32Rejected++;
+    pu8PDU[0] = u8MBFunction | 0x80;
+    pu8PDU[1] = u8MBStatus;
+    reply(u8Client, 2);
+  }
+}
+
+
+/**
+Serve a read from the cache or a queued request.
+
+@param u8Client client slot; _u16Address/_u16Qty hold the range to read
+@param u8MBSlave Modbus slave (unit identifier)
+@param u8MBFunction Modbus function (0x01..0x04)
+@return 0 if the read has been answered or attached to a queued request;
+ku8MBNoEntry if it must be forwarded
+*/
+uint8_t ModbusGateway::merge(uint8_t u8Client, uint8_t u8MBSlave,
+  uint8_t u8MBFunction)
+{
+  ModbusGatewayEntry *pEntry;
+  ModbusRequest *pRequest;
+  uint32_t u32Start = _u16Address[u8Client];
+  uint32_t u32End = u32Start + _u16Qty[u8Client];
+  uint32_t u32EntryStart, u32EntryEnd;
+  uint16_t u16Limit;
+  uint8_t i;
+  
+  u16Limit = (u8MBFunction <= ModbusMaster::ku8MBReadDiscreteInputs) ?
+    ku8MBGatewayMaxWords << 4 : ku8MBGatewayMaxWords;
+  
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    pEntry = &_pEntries[i];
+    pRequest = &pEntry->request;
+    if (pEntry->u8State == ku8MBEntryFree || pRequest->u8MBSlave != u8MBSlave ||
+      pRequest->u8MBFunction != u8MBFunction)
+    {
+      continue;
+    }
+    u32EntryStart = pRequest->u16ReadAddress;
+    u32EntryEnd = u32EntryStart + pRequest->u16ReadQty;
+    
+    if (pEntry->u8State == ku8MBEntryComplete)
+    {
+      if (u32Start >= u32EntryStart && u32End <= u32EntryEnd &&
+        pRequest->u8Status == ModbusMaster::ku8MBSuccess &&
+        millis() - pEntry->u32Time < _u16CacheTime)
+      {
+        _Stats.u32CacheHits++;
+        _u8Waiting[u8Client] = i;
+        bitSet(pEntry->u8Waiters, u8Client);
+        respond(u8Client);
+        return ModbusMaster::ku8MBSuccess;
+      }
+      continue;
+    }
+    
+    // widen a queued request that overlaps the read; adjacent ranges are
+    // left apart since they may lie in different register blocks
+    if (u32Start < u32EntryEnd && u32End > u32EntryStart &&
+      max(u32End, u32EntryEnd) - min(u32Start, u32EntryStart) <= u16Limit)
+    {
+      if (u32Start < u32EntryStart || u32End > u32EntryEnd)
+      {
+        pRequest->u16ReadAddress = min(u32Start, u32EntryStart);
+        pRequest->u16ReadQty = max(u32End, u32EntryEnd) - pRequest->u16ReadAddress;
+        _pBus->invalidate(pRequest);
+      }
+      _Stats.u32Merged++;
+      _u8Waiting[u8Client] = i;
+      bitSet(pEntry->u8Waiters, u8Client);
+      return ModbusMaster::ku8MBSuccess;
+    }
+  }
+  return ku8MBNoEntry;
+}
+
+
+/**
+Queue a request on the bus.
+
+Translates the request PDU into a free entry; a write also drops the
+cached reads of its slave.
+
+@param u8Client client slot
+@param u8Size size of the PDU in _u8Frame[7..] [bytes]
+@return 0 on success; Modbus exception code otherwise
+*/
+uint8_t ModbusGateway::forward(uint8_t u8Client, uint8_t u8Size)
+{
+  ModbusGatewayEntry *pEntry = 0;
+  ModbusRequest *pRequest;
+  uint8_t *pu8PDU = &_u8Frame[7];
+  uint8_t *pu8Data;
+  uint8_t u8MBSlave = _u8Frame[6];
+  uint16_t u16Address = word(pu8PDU[1], pu8PDU[2]);
+  uint16_t u16Qty = word(pu8PDU[3], pu8PDU[4]);
+  uint8_t i, u8Entry, u8MBStatus;
+  
+  // take a free entry, or the oldest completed read nobody waits for
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    if (_pEntries[i].u8State == ku8MBEntryFree)
+    {
+      pEntry = &_pEntries[i];
+      break;
+    }
+    if (_pEntries[i].u8State == ku8MBEntryComplete && !_pEntries[i].u8Waiters &&
+      (!pEntry || (int32_t) (_pEntries[i].u32Time - pEntry->u32Time) < 0))
+    {
+      pEntry = &_pEntries[i];
+    }
+  }
+  if (!pEntry)
+  {
+    return ku8MBSlaveDeviceBusy;
+  }
+  u8Entry = pEntry - _pEntries;
+  
+  pRequest = &pEntry->request;
+  pRequest->u8MBSlave = u8MBSlave;
+  pRequest->u8MBFunction = pu8PDU[0];
+  pRequest->u16ReadAddress = u16Address;
+  pRequest->u16ReadQty = u16Qty;
+  pRequest->u16WriteAddress = u16Address;
+  pRequest->u16WriteQty = u16Qty;
+  pRequest->pu16Data = pEntry->u16Data;
+  pRequest->u8Priority = ModbusMaster::ku8MBPriorityNormal;
+  pRequest->pfnComplete = 0;
+  pRequest->pNode = 0;
+  pu8Data = &pu8PDU[6];
+  u8MBStatus = ModbusMaster::ku8MBSuccess;
+  
+  switch(pRequest->u8MBFunction)
+  {
+    case ModbusMaster::ku8MBWriteSingleCoil:
+      if (u8Size != 5 || (u16Qty != 0x0000 && u16Qty != 0xFF00))
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      pRequest->u16WriteQty = u16Qty ? 1 : 0;
+      break;
+    
+    case ModbusMaster::ku8MBWriteSingleRegister:
+      if (u8Size != 5)
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      pEntry->u16Data[0] = u16Qty;
+      break;
+    
+    case ModbusMaster::ku8MBMaskWriteRegister:
+      if (u8Size != 7)
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      pEntry->u16Data[0] = word(pu8PDU[3], pu8PDU[4]);
+      pEntry->u16Data[1] = word(pu8PDU[5], pu8PDU[6]);
+      break;
+    
+    case ModbusMaster::ku8MBWriteMultipleCoils:
+      if (!u16Qty || u16Qty > (ku8MBGatewayMaxWords << 4) ||
+        u8Size < 6 || pu8PDU[5] != ((u16Qty + 7) >> 3) || u8Size != pu8PDU[5] + 6)
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      // coils packed 16 per word, first coil in the least significant bit
+      for (i = 0; i < pu8PDU[5]; i++)
+      {
+        if (i & 1)
+        {
+          pEntry->u16Data[i >> 1] |= pu8Data[i] << 8;
+        }
+        else
+        {
+          pEntry->u16Data[i >> 1] = pu8Data[i];
+        }
+      }
+      break;
+    
+    case ModbusMaster::ku8MBWriteMultipleRegisters:
+      if (!u16Qty || u16Qty > ku8MBGatewayMaxWords ||
+        u8Size < 6 || pu8PDU[5] != (u16Qty << 1) || u8Size != pu8PDU[5] + 6)
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      for (i = 0; i < u16Qty; i++)
+      {
+        pEntry->u16Data[i] = word(pu8Data[2 * i], pu8Data[2 * i + 1]);
+      }
+      break;
+    
+    case ModbusMaster::ku8MBReadWriteMultipleRegisters:
+      pRequest->u16WriteAddress = word(pu8PDU[5], pu8PDU[6]);
+      pRequest->u16WriteQty = word(pu8PDU[7], pu8PDU[8]);
+      pu8Data = &pu8PDU[10];
+      if (!u16Qty || u16Qty > ku8MBGatewayMaxWords ||
+        !pRequest->u16WriteQty || pRequest->u16WriteQty > ku8MBGatewayMaxWords ||
+        u8Size < 10 || pu8PDU[9] != (pRequest->u16WriteQty << 1) ||
+        u8Size != pu8PDU[9] + 10)
+      {
+        u8MBStatus = ModbusMaster::ku8MBIllegalDataValue;
+        break;
+      }
+      for (i = 0; i < pRequest->u16WriteQty; i++)
+      {
+        pEntry->u16Data[i] = word(pu8Data[2 * i], pu8Data[2 * i + 1]);
+      }
+      break;
+  }
+  
+  if (!u8MBStatus && _pBus->submit(pRequest))
+  {
+    u8MBStatus = ku8MBSlaveDeviceBusy;
+  }
+  if (u8MBStatus)
+  {
+    // the entry may have been a cache line; its contents are gone
+    pEntry->u8State = ku8MBEntryFree;
+    return u8MBStatus;
+  }
+  
+  // a write makes the slave's cached reads stale
+  if (pRequest->u8MBFunction > ModbusMaster::ku8MBReadInputRegisters)
+  {
+    expire(u8MBSlave);
+  }
+  
+  _Stats.u32Forwarded++;
+  pEntry->u8State = ku8MBEntryQueued;
+  pEntry->u8Waiters = 0;
+  bitSet(pEntry->u8Waiters, u8Client);
+  _u8Waiting[u8Client] = u8Entry;
+  return ModbusMaster::ku8MBSuccess;
+}
+
+
+/**
+Answer a client from the completed entry it waits for.
+
+Reads return the client's own range out of the (possibly wider) entry;
+RTU failures other than slave exceptions are reported as
+ku8MBGatewayTargetFailed.
+
+@param u8Client client slot
+*/
+void ModbusGateway::respond(uint8_t u8Client)
+{
+  ModbusGatewayEntry *pEntry = &_pEntries[_u8Waiting[u8Client]];
+  ModbusRequest *pRequest = &pEntry->request;
+  uint8_t *pu8PDU = &_u8Frame[7];
+  uint8_t u8Size = 1;
+  uint16_t u16Offset, u16Qty, u16Bit, i;
+  
+  pu8PDU[0] = pRequest->u8MBFunction;
+  u16Offset = _u16Address[u8Client] - pRequest->u16ReadAddress;
+  u16Qty = _u16Qty[u8Client];
+  
+  if (pRequest->u8Status)
+  {
+    pu8PDU[0] |= 0x80;
+    pu8PDU[u8Size++] = (pRequest->u8Status < ModbusMaster::ku8MBInvalidSlaveID) ?
+      pRequest->u8Status : ku8MBGatewayTargetFailed;
+  }
+  else
+  {
+    switch(pRequest->u8MBFunction)
+    {
+      case ModbusMaster::ku8MBReadCoils:
+      case ModbusMaster::ku8MBReadDiscreteInputs:
+        pu8PDU[u8Size++] = (u16Qty + 7) >> 3;
+        memset(&pu8PDU[u8Size], 0, (u16Qty + 7) >> 3);
+        for (i = 0; i < u16Qty; i++)
+        {
+          u16Bit = u16Offset + i;
+          if (bitRead(pEntry->u16Data[u16Bit >> 4], u16Bit & 15))
+          {
+            bitSet(pu8PDU[u8Size + (i >> 3)], i & 7);
+          }
+        }
+        u8Size += (u16Qty + 7) >> 3;
+        break;
+      
+      case ModbusMaster::ku8MBReadWriteMultipleRegisters:
+        u16Offset = 0;
+        u16Qty = pRequest->u16ReadQty;
+        // fall through
+      
+      case ModbusMaster::ku8MBReadHoldingRegisters:
+      case ModbusMaster::ku8MBReadInputRegisters:
+        pu8PDU[u8Size++] = u16Qty << 1;
+        for (i = 0; i < u16Qty; i++)
+        {
+          pu8PDU[u8Size++] = highByte(pEntry->u16Data[u16Offset + i]);
+          pu8PDU[u8Size++] = lowByte(pEntry->u16Data[u16Offset + i]);
+        }
+        break;
+      
+      default:
+        // writes echo address and quantity/value
+        pu8PDU[u8Size++] = highByte(pRequest->u16WriteAddress);
+        pu8PDU[u8Size++] = lowByte(pRequest->u16WriteAddress);
+        switch(pRequest->u8MBFunction)
+        {
+          case ModbusMaster::ku8MBWriteSingleCoil:
+            pu8PDU[u8Size++] = pRequest->u16WriteQty ? 0xFF : 0x00;
+            pu8PDU[u8Size++] = 0x00;
+            break;
+          
+          case ModbusMaster::ku8MBWriteSingleRegister:
+            pu8PDU[u8Size++] = highByte(pEntry->u16Data[0]);
+            pu8PDU[u8Size++] = lowByte(pEntry->u16Data[0]);
+            break;
+          
+          case ModbusMaster::ku8MBMaskWriteRegister:
+            for (i = 0; i < 2; i++)
+            {
+              pu8PDU[u8Size++] = highByte(pEntry->u16Data[i]);
+              pu8PDU[u8Size++] = lowByte(pEntry->u16Data[i]);
+            }
+            break;
+          
+          default:
+            pu8PDU[u8Size++] = highByte(pRequest->u16WriteQty);
+            pu8PDU[u8Size++] = lowByte(pRequest->u16WriteQty);
+            break;
+        }
+        break;
+    }
+  }
+  
+  bitClear(pEntry->u8Waiters, u8Client);
+  _u8Waiting[u8Client] = ku8MBNoEntry;
+  reply(u8Client, u8Size);
+}
+
+
+/**
+Send a response PDU to a client.
+
+The MBAP header repeats the transaction and unit identifiers of the
+client's request.
+
+@param u8Client client slot
+@param u8Size size of the PDU in _u8Frame[7..] [bytes]
+*/
+void ModbusGateway::reply(uint8_t u8Client, uint8_t u8Size)
+{
+  memcpy(_u8Frame, _u8Header[u8Client], 4);
+  _u8Frame[4] = highByte(u8Size + 1);
+  _u8Frame[5] = lowByte(u8Size + 1);
+  _u8Frame[6] = _u8Header[u8Client][6];
+  _pClient[u8Client]->write(_u8Frame, 7 + u8Size);
+}
+
+
+/**
+Drop the cached reads of a slave.
+
+@param u8MBSlave Modbus slave
+*/
+void ModbusGateway::expire(uint8_t u8MBSlave)
+{
+  uint8_t i;
+  
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    if (_pEntries[i].u8State == ku8MBEntryComplete && !_pEntries[i].u8Waiters &&
+      _pEntries[i].request.u8MBSlave == u8MBSlave &&
+      _pEntries[i].request.u8MBFunction <= ModbusMaster::ku8MBReadInputRegisters)
+    {
+      _pEntries[i].u8State = ku8MBEntryFree;
+    }
+  }
+}
+
+
+/**
+Release a client slot.
+
+@param u8Client client slot
+*/
+void ModbusGateway::drop(uint8_t u8Client)
+{
+  uint8_t i;
+  
+  for (i = 0; i < _u8EntryCount; i++)
+  {
+    bitClear(_pEntries[i].u8Waiters, u8Client);
+  }
+  _pClient[u8Client] = 0;
+  _u8HeaderSize[u8Client] = 0;
+  _u8Waiting[u8Client] = ku8MBNoEntry;
+}
@@ -0,0 +1,183 @@
+/**
+@file
+Modbus TCP to RTU gateway with request merging and a read cache.
+
+@defgroup gateway ModbusGateway Modbus TCP Clients and RTU Request Merging
+*/
+/*
+
+  ModbusGateway.h - Modbus TCP to RTU gateway with request merging
+  and a read cache.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+
+#ifndef ModbusGateway_h
+#define ModbusGateway_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+// include network client interface of Wiring core API
+#include <Client.h>
+
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+// RTU bus, request queue and function codes
+#include "ModbusMaster.h"
+
+
+/* _____TYPE DEFINITIONS_____________________________________________________ */
+struct ModbusGatewayEntry;
+
+
+/**
+Gateway statistics.
+
+@ingroup gateway
+*/
+struct ModbusGatewayStats
+{
+  uint32_t u32Requests;              ///< requests received from TCP clients
+  uint32_t u32CacheHits;             ///< reads answered from the cache
+  uint32_t u32Merged;                ///< reads merged into a queued RTU request
+  uint32_t u32Forwarded;             ///< RTU requests queued on the bus
+  uint32_t u32Rejected;              ///< requests refused by the gateway itself (exception response)
+};
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Modbus TCP to RTU gateway.
+
+Reads Modbus TCP (MBAP) requests from up to ku8MBGatewayMaxClients
+connections and forwards them to the RTU bus through the
+ModbusMaster request queue; the unit identifier selects the slave.
+
+Reads (functions 0x01..0x04) are merged: a read covered by a queued
+request for the same slave and function waits for that request, and an
+overlapping one widens it to the union of both ranges. Adjacent reads
+are not joined: many slaves reject a read that crosses the boundary
+between two register blocks even though each block reads fine on its
+own. Completed reads stay in their entry for the cache time and answer
+any read they cover. A write drops the cached reads of its slave.
+
+Each client has at most one request outstanding and the bus queue is
+served in order, so clients are served round robin.
+
+@ingroup gateway
+*/
+class ModbusGateway
+{
+  public:
+    ModbusGateway(ModbusMaster &);
+    
+    void    setEntries(ModbusGatewayEntry *, uint8_t);
+    void    setCacheTime(uint16_t);
+    uint8_t addClient(Client &);
+    void    removeClient(Client &);
+    void    poll();
+    void    getStats(ModbusGatewayStats *);
+    void    clearStats();
+    
+    /**
+    Maximum number of TCP connections served at once.
+    
+    @ingroup gateway
+    */
+    static const uint8_t ku8MBGatewayMaxClients          = 4;
+    
+    /**
+    Maximum quantity of registers per request (coils: 16 per register),
+    the size of the ModbusMaster transmit/response buffers.
+    
+    @ingroup gateway
+    */
+    static const uint8_t ku8MBGatewayMaxWords            = __MODBUSMASTER_BUFFER_SIZE__;
+    
+    /**
+    Modbus protocol slave device busy exception.
+    
+    Returned when every gateway entry is in use.
+    
+    @ingroup gateway
+    */
+    static const uint8_t ku8MBSlaveDeviceBusy            = 0x06;
+    
+    /**
+    Modbus protocol gateway target device failed to respond exception.
+    
+    Returned when the RTU slave did not answer, or answered with a frame
+    that failed the ModbusMaster checks (slave ID, function, CRC).
+    
+    @ingroup gateway
+    */
+    static const uint8_t ku8MBGatewayTargetFailed        = 0x0B;
+    
+  private:
+    ModbusMaster *_pBus;                                         ///< RTU bus requests are forwarded to
+    ModbusGatewayEntry *_pEntries;                               ///< request/cache entries (0 = none)
+    uint8_t  _u8EntryCount;                                      ///< number of entries
+    uint16_t _u16CacheTime;                                      ///< time a completed read stays valid [milliseconds]
+    ModbusGatewayStats _Stats;                                   ///< gateway statistics
+    
+    Client   *_pClient[ku8MBGatewayMaxClients];                  ///< TCP connections (0 = free slot)
+    uint8_t  _u8Header[ku8MBGatewayMaxClients][7];               ///< MBAP header of the client's current request
+    uint8_t  _u8HeaderSize[ku8MBGatewayMaxClients];              ///< bytes received of the MBAP header
+    uint8_t  _u8Waiting[ku8MBGatewayMaxClients];                 ///< entry the client waits for (ku8MBNoEntry = none)
+    uint16_t _u16Address[ku8MBGatewayMaxClients];                ///< first register/coil the client asked for
+    uint16_t _u16Qty[ku8MBGatewayMaxClients];                    ///< quantity of registers/coils the client asked for
+    uint8_t  _u8Frame[260];                                      ///< MBAP frame being received or sent
+    
+    // Gateway entry states
+    static const uint8_t ku8MBEntryFree                  = 0;    ///< entry unused
+    static const uint8_t ku8MBEntryQueued                = 1;    ///< request queued on the bus
+    static const uint8_t ku8MBEntryComplete              = 2;    ///< request executed; reads serve as cache
+    static const uint8_t ku8MBNoEntry                    = 0xFF; ///< client is not waiting for an entry
+    
+    void    receive(uint8_t);
+    void    handle(uint8_t, uint8_t);
+    uint8_t merge(uint8_t, uint8_t, uint8_t);
+    uint8_t forward(uint8_t, uint8_t);
+    void    respond(uint8_t);
+    void    reply(uint8_t, uint8_t);
+    void    expire(uint8_t);
+    void    drop(uint8_t);
+};
+
+
+/**
+Gateway request/cache entry.
+
+Storage for one RTU request and its data, supplied by the caller
+through ModbusGateway::setEntries(). An entry carries a request while it
+is queued and, for reads, serves as a cache line once it has completed.
+
+@ingroup gateway
+*/
+struct ModbusGatewayEntry
+{
+  ModbusRequest request;                                         ///< RTU request
+  uint16_t u16Data[ModbusGateway::ku8MBGatewayMaxWords];         ///< write data; read data once completed
+  uint32_t u32Time;                                              ///< completion time [milliseconds]
+  uint8_t  u8Waiters;                                            ///< clients waiting for the response (bit n = client n)
+  uint8_t  u8State;                                              ///< free, queued or complete
+};
+#endif
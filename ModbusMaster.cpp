@@ -35,6 +35,33 @@ Arduino library for communicating with Modbus slaves over RS232/485 (via RTU pro
 
 /* _____GLOBAL VARIABLES_____________________________________________________ */
 HardwareSerial MBSerial = Serial; ///< Pointer to Serial class object
+volatile uint8_t MBTXComplete;    ///< set by the USART1 TX-complete interrupt
+volatile uint8_t *MBDEPort;       ///< driver enable port released by the TX-complete interrupt
+uint8_t MBDEMask;                 ///< driver enable mask released by the TX-complete interrupt (0 = none)
+volatile uint8_t *MBREPort;       ///< receiver enable (active low) port re-enabled by the TX-complete interrupt
+uint8_t MBREMask;                 ///< receiver enable mask re-enabled by the TX-complete interrupt (0 = none)
+
+
+/* _____INTERRUPT HANDLERS___________________________________________________ */
+#if defined(USART1_TX_vect)
+/**
+USART1 TX-complete interrupt.
+
+Used for serial port 1 only. Enabled once a request has been queued for 
+transmission; fires when the last stop bit has left the shift register. Releases the RS-485 driver 
+and re-enables the receiver right here when no post-transmission delay 
+is configured, so the line is turned around within a few cycles of the 
+stop bit regardless of what the main context is doing. Also wakes the 
+MCU from idle sleep.
+*/
+ISR(USART1_TX_vect)
+{
+  UCSR1B &= ~(1 << TXCIE1);
+  if (MBDEMask) *MBDEPort &= ~MBDEMask;
+  if (MBREMask) *MBREPort &= ~MBREMask;
+  MBTXComplete = 1;
+}
+#endif
 
 
 /* _____PUBLIC FUNCTIONS_____________________________________________________ */
@@ -49,6 +76,46 @@ ModbusMaster::ModbusMaster(void)
 {
   _u8SerialPort = 0;
   _u8MBSlave = 1;
+  _u32BaudRate = 0;
+  _u8SerialConfig = SERIAL_8N1;
+  _u8RTSMask = 0;
+  _tMBResponseTimeout = ku8MBResponseTimeout;
+#if __MODBUSMASTER_FILE__
+  _pfnRecordSink = 0;
+  _pfnRecordSource = 0;
+#endif
+  _pu8BitData = 0;
+#if __MODBUSMASTER_SCAN__
+  _pScanTable = 0;
+  _u8ScanCount = 0;
+#endif
+  _u8IdleSleep = 0;
+  _u32SleepTime = 0;
+#if __MODBUSMASTER_CAPTURE__
+  _pu8Capture = 0;
+#endif
+#if __MODBUSMASTER_HEALTH__
+  _pErrorLog = 0;
+  _u8ErrorLogCount = 0;
+  _pHealth = 0;
+  _u16DegradeThreshold = 0;
+#endif
+  _u8REMask = 0;
+  _u16PreDelay = 0;
+  _u16PostDelay = 0;
+  _pfnPreTransmission = 0;
+  _pfnPostTransmission = 0;
+  _pQueue = 0;
+  _u16ServiceSeq = 0;
+  _pActive = 0;
+  _pPrepared = 0;
+  _u8PreparedSize = 0;
+  _u8PrepareAhead = 0;
+  _u32LastFrameEnd = 0;
+  _u8UrgentPending = 0;
+  _u8UrgentHold = 0;
+  _u8FrameSize = 0;
+  clearLatencyStats();
 }
 
 
@@ -65,6 +132,46 @@ ModbusMaster::ModbusMaster(uint8_t u8MBSlave)
 {
   _u8SerialPort = 0;
   _u8MBSlave = u8MBSlave;
+  _u32BaudRate = 0;
+  _u8SerialConfig = SERIAL_8N1;
+  _u8RTSMask = 0;
+  _tMBResponseTimeout = ku8MBResponseTimeout;
+#if __MODBUSMASTER_FILE__
+  _pfnRecordSink = 0;
+  _pfnRecordSource = 0;
+#endif
+  _pu8BitData = 0;
+#if __MODBUSMASTER_SCAN__
+  _pScanTable = 0;
+  _u8ScanCount = 0;
+#endif
+  _u8IdleSleep = 0;
+  _u32SleepTime = 0;
+#if __MODBUSMASTER_CAPTURE__
+  _pu8Capture = 0;
+#endif
+#if __MODBUSMASTER_HEALTH__
+  _pErrorLog = 0;
+  _u8ErrorLogCount = 0;
+  _pHealth = 0;
+  _u16DegradeThreshold = 0;
+#endif
+  _u8REMask = 0;
+  _u16PreDelay = 0;
+  _u16PostDelay = 0;
+  _pfnPreTransmission = 0;
+  _pfnPostTransmission = 0;
+  _pQueue = 0;
+  _u16ServiceSeq = 0;
+  _pActive = 0;
+  _pPrepared = 0;
+  _u8PreparedSize = 0;
+  _u8PrepareAhead = 0;
+  _u32LastFrameEnd = 0;
+  _u8UrgentPending = 0;
+  _u8UrgentHold = 0;
+  _u8FrameSize = 0;
+  clearLatencyStats();
 }
 
 
@@ -82,7 +189,46 @@ ModbusMaster::ModbusMaster(uint8_t u8SerialPort, uint8_t u8MBSlave)
 {
   _u8SerialPort = (u8SerialPort > 3) ? 0 : u8SerialPort;
   _u8MBSlave = u8MBSlave;
+  _u32BaudRate = 0;
+  _u8SerialConfig = SERIAL_8N1;
   _u8RTSMask = 0; //Unused by default
+  _tMBResponseTimeout = ku8MBResponseTimeout;
+#if __MODBUSMASTER_FILE__
+  _pfnRecordSink = 0;
+  _pfnRecordSource = 0;
+#endif
+  _pu8BitData = 0;
+#if __MODBUSMASTER_SCAN__
+  _pScanTable = 0;
+  _u8ScanCount = 0;
+#endif
+  _u8IdleSleep = 0;
+  _u32SleepTime = 0;
+#if __MODBUSMASTER_CAPTURE__
+  _pu8Capture = 0;
+#endif
+#if __MODBUSMASTER_HEALTH__
+  _pErrorLog = 0;
+  _u8ErrorLogCount = 0;
+  _pHealth = 0;
+  _u16DegradeThreshold = 0;
+#endif
+  _u8REMask = 0;
+  _u16PreDelay = 0;
+  _u16PostDelay = 0;
+  _pfnPreTransmission = 0;
+  _pfnPostTransmission = 0;
+  _pQueue = 0;
+  _u16ServiceSeq = 0;
+  _pActive = 0;
+  _pPrepared = 0;
+  _u8PreparedSize = 0;
+  _u8PrepareAhead = 0;
+  _u32LastFrameEnd = 0;
+  _u8UrgentPending = 0;
+  _u8UrgentHold = 0;
+  _u8FrameSize = 0;
+  clearLatencyStats();
 }
 
 
@@ -141,6 +287,8 @@ void ModbusMaster::begin(uint32_t BaudRate, uint8_t config)
       break;
   }
   
+  _u32BaudRate = BaudRate;
+  _u8SerialConfig = config;
   MBSerial.begin(BaudRate, config);
 }
 
@@ -154,6 +302,279 @@ void ModbusMaster::setupRTS(uint8_t pinID)
     *pDDRx |= _u8RTSMask; //Set as output
 }
 
+
+/**
+Set up RS-485 direction control with separate DE and /RE pins.
+
+The driver enable (DE) pin is driven high and the receiver enable (/RE, 
+active low) pin high while a request is transmitted, so the master does 
+not receive its own echo; both are returned low at the end of the last 
+stop bit. Use setupRTS(uint8_t) when DE and /RE are tied together.
+
+@overload void ModbusMaster::setupRTS(uint8_t u8DEPin, uint8_t u8REPin)
+@param u8DEPin driver enable pin
+@param u8REPin receiver enable pin (active low)
+@ingroup setup
+*/
+void ModbusMaster::setupRTS(uint8_t u8DEPin, uint8_t u8REPin)
+{
+  uint8_t u8PortID;
+  
+  setupRTS(u8DEPin);
+  u8PortID = digitalPinToPort(u8REPin);
+  _u8REMask = digitalPinToBitMask(u8REPin);
+  _u8REPort = portOutputRegister(u8PortID);
+  *portModeRegister(u8PortID) |= _u8REMask;
+  *_u8REPort &= ~_u8REMask;
+}
+
+
+/**
+Set RS-485 guard times.
+
+The pre-transmission delay is inserted after the driver is enabled and 
+before the first start bit, for transceivers that need time to settle. 
+The post-transmission delay holds the driver after the last stop bit, 
+for transceivers that truncate the final character if released 
+immediately. With a post delay of 0 (default) the driver is released by 
+the TX-complete interrupt, giving the shortest safe turnaround.
+
+@param u16PreDelay driver enable to first start bit [microseconds]
+@param u16PostDelay last stop bit to driver release [microseconds]
+@ingroup setup
+*/
+void ModbusMaster::setTransmitDelays(uint16_t u16PreDelay, uint16_t u16PostDelay)
+{
+  _u16PreDelay = u16PreDelay;
+  _u16PostDelay = u16PostDelay;
+}
+
+
+/**
+Set RS-485 direction callbacks.
+
+For transceivers not driven by a plain output pin. pfnPre is called 
+before transmitting (ahead of the pre-transmission delay) and pfnPost 
+after the last stop bit (after the post-transmission delay); both run 
+in the caller's context, not from the interrupt.
+
+@param pfnPre callback enabling the driver (0 = none)
+@param pfnPost callback releasing the driver (0 = none)
+@ingroup setup
+*/
+void ModbusMaster::setDirectionCallbacks(MBDirectionCallback pfnPre,
+  MBDirectionCallback pfnPost)
+{
+  _pfnPreTransmission = pfnPre;
+  _pfnPostTransmission = pfnPost;
+}
+
+/**
+Set response timeout.
+
+Sets the time allowed for the slave to return a complete response.
+Defaults to ModbusMaster::ku8MBResponseTimeout (200 ms).
+
+@param tTimeout response timeout [milliseconds] (1 up to the maximum of 
+__MODBUSMASTER_TIMEOUT_TYPE__)
+@ingroup setup
+*/
+void ModbusMaster::setResponseTimeout(MBTimeout tTimeout)
+{
+  _tMBResponseTimeout = tTimeout ? tTimeout : 1;
+}
+
+
+/**
+Enable idle sleep while waiting on the serial port.
+
+When enabled, the MCU enters idle sleep instead of busy-waiting during 
+the t3.5 silence before a request, while the request is shifted out 
+(serial port 1 only; other ports wait in the core's flush()), and while 
+waiting for (and between) response characters. It is woken by the UART RX, UDRE and TX-complete interrupts, 
+or by the timer 0 overflow that drives millis(), which bounds the 
+response timeout to within about 1 ms. Timers and the UART keep running 
+in idle mode.
+
+@param u8Enable 0=busy wait (default), non-zero=idle sleep
+@ingroup setup
+*/
+void ModbusMaster::setIdleSleep(uint8_t u8Enable)
+{
+  _u8IdleSleep = u8Enable;
+}
+
+
+/**
+Retrieve accumulated idle sleep time.
+
+Compare with the elapsed time across transactions to obtain the share 
+of the response window the MCU spent asleep.
+
+@return time spent in idle sleep since construction [microseconds]
+@ingroup setup
+*/
+uint32_t ModbusMaster::getSleepTime()
+{
+  return _u32SleepTime;
+}
+
+
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__ && __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+/**
+Negotiate the fastest reliable serial setting for a bus.
+
+First finds the candidate setting all slaves answer at, trying the 
+candidates in order. If every slave has a profile that supports it, 
+each other candidate at least as fast is then tried: the slaves are 
+switched to it by their profile's register writes, probed 
+ModbusMaster::ku8MBLinkProbes times each, and switched back. The bus 
+ends at the tried setting with the highest throughput at which no probe 
+failed, or at the setting found if none did better.
+
+If some slaves do not answer after being switched back, the bus is 
+probed at the tried setting. It is kept if all slaves answer there; 
+otherwise the slaves still at it are switched back once more.
+
+A probe reads the profile's baud rate register (register 0 for slaves 
+without a profile); exception responses count as answers. The response 
+timeout is restored on return. Call after begin(), with the bus 
+otherwise idle.
+
+@param pu8Slaves slave IDs on the bus (1..247)
+@param ppProfiles profile per slave, 0 for a slave whose settings cannot 
+be changed (0 = no profiles; only find the current setting)
+@param u8SlaveCount number of slaves in pu8Slaves
+@param pSettings candidate settings
+@param u8SettingCount number of candidates in pSettings
+@param pQuality link quality per candidate, in candidate order (0 = not needed)
+@return index of the setting the bus is left at; ku8MBLinkNotFound if the 
+slaves answered at none, or could not be brought back to a common 
+setting (the original setting is restored)
+@ingroup setup
+*/
+uint8_t ModbusMaster::negotiateLink(const uint8_t *pu8Slaves,
+  const ModbusBaudProfile * const *ppProfiles, uint8_t u8SlaveCount,
+  const ModbusLinkSetting *pSettings, uint8_t u8SettingCount,
+  ModbusLinkQuality *pQuality)
+{
+  uint32_t u32SavedBaudRate = _u32BaudRate;
+  uint8_t u8SavedConfig = _u8SerialConfig;
+  uint8_t u8SavedSlave = _u8MBSlave;
+  MBTimeout tSavedTimeout = _tMBResponseTimeout;
+  ModbusLinkQuality mqTry, mqBest;
+  uint8_t u8Current = ku8MBLinkNotFound;
+  uint8_t u8Best, i;
+#if __MODBUSMASTER_HEALTH__
+  ModbusErrorEvent *pErrorLog = _pErrorLog;
+  ModbusSlaveHealth *pHealth = _pHealth;
+  
+  // probes at the wrong setting are expected to fail; keep them out of 
+  // the error log
+  _pErrorLog = 0;
+  _pHealth = 0;
+#endif
+  
+  // urgent requests go first; during negotiation the bus may be at any 
+  // setting
+  serviceUrgent();
+  _u8UrgentHold++;
+  
+  if (pQuality)
+  {
+    memset(pQuality, 0, u8SettingCount * sizeof(ModbusLinkQuality));
+  }
+  
+  // find the setting the slaves are listening at
+  for (i = 0; i < u8SettingCount && u8Current == ku8MBLinkNotFound; i++)
+  {
+    setLink(&pSettings[i]);
+    if (!probeLink(pu8Slaves, ppProfiles, u8SlaveCount, 1, &mqTry))
+    {
+      u8Current = i;
+    }
+  }
+  
+  if (u8Current == ku8MBLinkNotFound)
+  {
+    begin(u32SavedBaudRate, u8SavedConfig);
+  }
+  else
+  {
+    u8Best = u8Current;
+    probeLink(pu8Slaves, ppProfiles, u8SlaveCount, ku8MBLinkProbes, &mqBest);
+    if (pQuality)
+    {
+      pQuality[u8Current] = mqBest;
+    }
+    
+    for (i = 0; i < u8SettingCount; i++)
+    {
+      if (i == u8Current || pSettings[i].u32BaudRate < pSettings[u8Current].u32BaudRate ||
+        !canSwitchLink(ppProfiles, u8SlaveCount, pSettings, u8Current, i))
+      {
+        continue;
+      }
+      
+      // measure the candidate, then return to the current setting
+      switchLink(pu8Slaves, ppProfiles, u8SlaveCount, pSettings, i);
+      probeLink(pu8Slaves, ppProfiles, u8SlaveCount, ku8MBLinkProbes, &mqTry);
+      if (pQuality)
+      {
+        pQuality[i] = mqTry;
+      }
+      if (!mqTry.u16Errors && (mqBest.u16Errors || mqTry.u32Throughput > mqBest.u32Throughput))
+      {
+        u8Best = i;
+        mqBest = mqTry;
+      }
+      switchLink(pu8Slaves, ppProfiles, u8SlaveCount, pSettings, u8Current);
+      if (!probeLink(pu8Slaves, ppProfiles, u8SlaveCount, 1, &mqTry))
+      {
+        continue;
+      }
+      
+      // some slaves did not take the way back; stay at the candidate if 
+      // all of them did not
+      setLink(&pSettings[i]);
+      if (!probeLink(pu8Slaves, ppProfiles, u8SlaveCount, 1, &mqTry))
+      {
+        u8Current = i;
+        continue;
+      }
+      
+      // otherwise send those still at the candidate back as well
+      switchLink(pu8Slaves, ppProfiles, u8SlaveCount, pSettings, u8Current);
+      if (probeLink(pu8Slaves, ppProfiles, u8SlaveCount, 1, &mqTry))
+      {
+        u8Current = ku8MBLinkNotFound;
+        break;
+      }
+    }
+    
+    if (u8Current == ku8MBLinkNotFound)
+    {
+      begin(u32SavedBaudRate, u8SavedConfig);
+    }
+    else if (u8Best != u8Current)
+    {
+      switchLink(pu8Slaves, ppProfiles, u8SlaveCount, pSettings, u8Best);
+      u8Current = u8Best;
+    }
+  }
+  
+  _u8MBSlave = u8SavedSlave;
+  _tMBResponseTimeout = tSavedTimeout;
+#if __MODBUSMASTER_HEALTH__
+  _pErrorLog = pErrorLog;
+  _pHealth = pHealth;
+#endif
+  _u8UrgentHold--;
+  return u8Current;
+}
+#endif
+
+
 /**
 Retrieve data from response buffer.
 
@@ -232,6 +653,7 @@ void ModbusMaster::clearTransmitBuffer()
 }
 
 
+#if __MODBUSMASTER_READ_COILS__
 /**
 Modbus function 0x01 Read Coils.
 
@@ -257,12 +679,47 @@ order end of the word).
 */
 uint8_t ModbusMaster::readCoils(uint16_t u16ReadAddress, uint16_t u16BitQty)
 {
+  serviceUrgent();
   _u16ReadAddress = u16ReadAddress;
   _u16ReadQty = u16BitQty;
   return ModbusMasterTransaction(ku8MBReadCoils);
 }
 
 
+/**
+Modbus function 0x01 Read Coils into a bit set.
+
+Reads bsCoils.size() coils (1..2000) starting at u16ReadAddress. The 
+coil bytes are copied from the response frame into the bit set as-is; 
+the response buffer is not used. Larger bit sets are rejected with 
+ModbusMaster::ku8MBIllegalDataValue.
+
+@overload uint8_t ModbusMaster::readCoils(uint16_t u16ReadAddress, ModbusBitSet &bsCoils)
+@param u16ReadAddress address of first coil (0x0000..0xFFFF)
+@param bsCoils destination bit set
+@return 0 on success; exception number on failure
+@ingroup bitset
+*/
+uint8_t ModbusMaster::readCoils(uint16_t u16ReadAddress, ModbusBitSet &bsCoils)
+{
+  uint8_t u8MBStatus;
+  
+  if (bsCoils.size() > ku16MBMaxReadBits)
+  {
+    return ku8MBIllegalDataValue;
+  }
+  serviceUrgent();
+  _u16ReadAddress = u16ReadAddress;
+  _u16ReadQty = bsCoils.size();
+  _pu8BitData = bsCoils.data();
+  u8MBStatus = ModbusMasterTransaction(ku8MBReadCoils);
+  _pu8BitData = 0;
+  return u8MBStatus;
+}
+#endif
+
+
+#if __MODBUSMASTER_READ_DISCRETE_INPUTS__
 /**
 Modbus function 0x02 Read Discrete Inputs.
 
@@ -289,12 +746,48 @@ order end of the word).
 uint8_t ModbusMaster::readDiscreteInputs(uint16_t u16ReadAddress,
   uint16_t u16BitQty)
 {
+  serviceUrgent();
   _u16ReadAddress = u16ReadAddress;
   _u16ReadQty = u16BitQty;
   return ModbusMasterTransaction(ku8MBReadDiscreteInputs);
 }
 
 
+/**
+Modbus function 0x02 Read Discrete Inputs into a bit set.
+
+Reads bsInputs.size() discrete inputs (1..2000) starting at 
+u16ReadAddress. The input bytes are copied from the response frame into 
+the bit set as-is; the response buffer is not used. Larger bit sets are 
+rejected with ModbusMaster::ku8MBIllegalDataValue.
+
+@overload uint8_t ModbusMaster::readDiscreteInputs(uint16_t u16ReadAddress, ModbusBitSet &bsInputs)
+@param u16ReadAddress address of first discrete input (0x0000..0xFFFF)
+@param bsInputs destination bit set
+@return 0 on success; exception number on failure
+@ingroup bitset
+*/
+uint8_t ModbusMaster::readDiscreteInputs(uint16_t u16ReadAddress,
+  ModbusBitSet &bsInputs)
+{
+  uint8_t u8MBStatus;
+  
+  if (bsInputs.size() > ku16MBMaxReadBits)
+  {
+    return ku8MBIllegalDataValue;
+  }
+  serviceUrgent();
+  _u16ReadAddress = u16ReadAddress;
+  _u16ReadQty = bsInputs.size();
+  _pu8BitData = bsInputs.data();
+  u8MBStatus = ModbusMasterTransaction(ku8MBReadDiscreteInputs);
+  _pu8BitData = 0;
+  return u8MBStatus;
+}
+#endif
+
+
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__
 /**
 Modbus function 0x03 Read Holding Registers.
 
@@ -314,12 +807,15 @@ register.
 uint8_t ModbusMaster::readHoldingRegisters(uint16_t u16ReadAddress,
   uint16_t u16ReadQty)
 {
+  serviceUrgent();
   _u16ReadAddress = u16ReadAddress;
   _u16ReadQty = u16ReadQty;
   return ModbusMasterTransaction(ku8MBReadHoldingRegisters);
 }
+#endif
 
 
+#if __MODBUSMASTER_READ_INPUT_REGISTERS__
 /**
 Modbus function 0x04 Read Input Registers.
 
@@ -339,12 +835,15 @@ register.
 uint8_t ModbusMaster::readInputRegisters(uint16_t u16ReadAddress,
   uint8_t u16ReadQty)
 {
+  serviceUrgent();
   _u16ReadAddress = u16ReadAddress;
   _u16ReadQty = u16ReadQty;
   return ModbusMasterTransaction(ku8MBReadInputRegisters);
 }
+#endif
 
 
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__
 /**
 Modbus function 0x05 Write Single Coil.
 
@@ -361,12 +860,15 @@ address of the coil to be forced. Coils are addressed starting at zero.
 */
 uint8_t ModbusMaster::writeSingleCoil(uint16_t u16WriteAddress, uint8_t u8State)
 {
+  serviceUrgent();
   _u16WriteAddress = u16WriteAddress;
   _u16WriteQty = (u8State ? 0xFF00 : 0x0000);
   return ModbusMasterTransaction(ku8MBWriteSingleCoil);
 }
+#endif
 
 
+#if __MODBUSMASTER_WRITE_SINGLE_REGISTER__
 /**
 Modbus function 0x06 Write Single Register.
 
@@ -382,13 +884,16 @@ written. Registers are addressed starting at zero.
 uint8_t ModbusMaster::writeSingleRegister(uint16_t u16WriteAddress,
   uint16_t u16WriteValue)
 {
+  serviceUrgent();
   _u16WriteAddress = u16WriteAddress;
   _u16WriteQty = 0;
   _u16TransmitBuffer[0] = u16WriteValue;
   return ModbusMasterTransaction(ku8MBWriteSingleRegister);
 }
+#endif
 
 
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__
 /**
 Modbus function 0x0F Write Multiple Coils.
 
@@ -414,6 +919,40 @@ uint8_t ModbusMaster::writeMultipleCoils(uint16_t u16WriteAddress,
 }
 
 
+/**
+Modbus function 0x0F Write Multiple Coils from a bit set.
+
+Writes bsCoils.size() coils (1..1968) starting at u16WriteAddress. The 
+bit set bytes are copied into the request frame as-is; the transmit 
+buffer is not used.
+
+@overload uint8_t ModbusMaster::writeMultipleCoils(uint16_t u16WriteAddress, ModbusBitSet &bsCoils)
+@param u16WriteAddress address of the first coil (0x0000..0xFFFF)
+@param bsCoils coil states to write
+@return 0 on success; exception number on failure
+@ingroup bitset
+*/
+uint8_t ModbusMaster::writeMultipleCoils(uint16_t u16WriteAddress,
+  ModbusBitSet &bsCoils)
+{
+  uint8_t u8MBStatus;
+  
+  if (bsCoils.size() > ku16MBMaxWriteCoils)
+  {
+    return ku8MBIllegalDataValue;
+  }
+  serviceUrgent();
+  _u16WriteAddress = u16WriteAddress;
+  _u16WriteQty = bsCoils.size();
+  _pu8BitData = bsCoils.data();
+  u8MBStatus = ModbusMasterTransaction(ku8MBWriteMultipleCoils);
+  _pu8BitData = 0;
+  return u8MBStatus;
+}
+#endif
+
+
+#if __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
 /**
 Modbus function 0x10 Write Multiple Registers.
 
@@ -435,8 +974,10 @@ uint8_t ModbusMaster::writeMultipleRegisters(uint16_t u16WriteAddress,
   _u16WriteQty = u16WriteQty;
   return ModbusMasterTransaction(ku8MBWriteMultipleRegisters);
 }
+#endif
 
 
+#if __MODBUSMASTER_MASK_WRITE_REGISTER__
 /**
 Modbus function 0x16 Mask Write Register.
 
@@ -462,13 +1003,16 @@ Result = (Current Contents && And_Mask) || (Or_Mask && (~And_Mask))
 uint8_t ModbusMaster::maskWriteRegister(uint16_t u16WriteAddress,
   uint16_t u16AndMask, uint16_t u16OrMask)
 {
+  serviceUrgent();
   _u16WriteAddress = u16WriteAddress;
   _u16TransmitBuffer[0] = u16AndMask;
   _u16TransmitBuffer[1] = u16OrMask;
   return ModbusMasterTransaction(ku8MBMaskWriteRegister);
 }
+#endif
 
 
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
 /**
 Modbus function 0x17 Read Write Multiple Registers.
 
@@ -498,80 +1042,2254 @@ uint8_t ModbusMaster::readWriteMultipleRegisters(uint16_t u16ReadAddress,
   _u16WriteQty = u16WriteQty;
   return ModbusMasterTransaction(ku8MBReadWriteMultipleRegisters);
 }
+#endif
 
 
-/* _____PRIVATE FUNCTIONS____________________________________________________ */
+#if __MODBUSMASTER_DIAGNOSTIC__
 /**
-Modbus transaction engine.
-Sequence:
-  - assemble Modbus Request Application Data Unit (ADU),
-    based on particular function called
-  - transmit request over selected serial port
-  - wait for/retrieve response
-  - evaluate/disassemble response
-  - return status (success/exception)
+Modbus function 0x08 Diagnostics.
 
-@param u8MBFunction Modbus function (0x01..0xFF)
+This function code provides a series of tests for checking the 
+communication system between a client (master) device and a server 
+(slave), or for checking various internal error conditions within a 
+server. The sub-function code selects the test to perform (see 
+ModbusMaster::ku16MBReturnQueryData and related constants).
+
+The data word returned by the slave (loopback data or the requested 
+counter) is placed in word 0 of the response buffer.
+
+Diagnostics is defined for serial lines only; broadcast requests are 
+not supported.
+
+@param u16SubFunction diagnostics sub-function (0x0000..0xFFFF)
+@param u16Data request data field (0x0000..0xFFFF)
 @return 0 on success; exception number on failure
+@ingroup diagnostic
 */
-uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
+uint8_t ModbusMaster::diagnostics(uint16_t u16SubFunction, uint16_t u16Data)
 {
-  uint8_t u8ModbusADU[256];
-  uint8_t u8ModbusADUSize = 0;
-  uint8_t i, u8Qty;
-  uint16_t u16CRC;
-  uint32_t u32RXStartTime;
-  uint8_t u8BytesLeft = 8;
-  uint8_t u8MBStatus = ku8MBSuccess;
+  serviceUrgent();
+  _u16WriteAddress = u16SubFunction;
+  _u16WriteQty = u16Data;
+  return ModbusMasterTransaction(ku8MBDiagnostics);
+}
+
+
+/**
+Modbus function 0x2B/0x0E Read Device Identification.
+
+This function code allows reading the identification and additional 
+information relative to the physical and functional description of a 
+remote device (vendor name, product code, revision, ...).
+
+The response buffer is filled as follows:
+  - word 0: conformity level (high byte), more follows flag (low byte)
+  - word 1: next object ID (high byte), number of objects (low byte)
+  - word 2..: object list packed as bytes H, L, H, L, ... where each 
+    object is [object ID, length, value...]
+
+Objects that do not fit the response buffer are truncated. If the more 
+follows flag is set, issue another request starting at the returned 
+next object ID.
+
+@param u8ReadDevIdCode read device ID code (ku8MBDeviceIdBasic..ku8MBDeviceIdSpecific)
+@param u8ObjectId first object to read (0x00..0xFF)
+@return 0 on success; exception number on failure
+@ingroup diagnostic
+*/
+uint8_t ModbusMaster::readDeviceIdentification(uint8_t u8ReadDevIdCode,
+  uint8_t u8ObjectId)
+{
+  serviceUrgent();
+  _u16ReadAddress = u8ReadDevIdCode;
+  _u16ReadQty = u8ObjectId;
+  return ModbusMasterTransaction(ku8MBEncapsulatedInterface);
+}
+
+
+/**
+Scan a range of slave IDs for responding devices.
+
+Each ID is probed with a Diagnostics Return Query Data request. Any 
+valid reply, including a Modbus exception (e.g. a slave that does not 
+implement function 0x08), marks the ID as present.
+
+Rather than waiting out the full response timeout for every absent ID, 
+the probe timeout is derived from the baud rate: the time to transmit 
+the request and its echo plus ModbusMaster::ku8MBScanTurnaround. It is 
+widened adaptively to twice the slowest reply seen so far, so slow 
+slaves discovered early are not missed later in the scan. Anything still 
+arriving from the previous ID is discarded before each probe. The 
+original slave ID and response timeout are restored on return.
+
+RTU allows only one outstanding request per serial line, so probes are 
+issued sequentially.
+
+@param u8FirstID first slave ID to probe (1..247)
+@param u8LastID last slave ID to probe (1..247)
+@param pu8Map 32-byte bitmap; cleared, then bit n is set if slave ID n 
+responded
+@return number of slaves found
+@ingroup diagnostic
+*/
+uint8_t ModbusMaster::discoverSlaves(uint8_t u8FirstID, uint8_t u8LastID,
+  uint8_t *pu8Map)
+{
+  uint8_t u8SavedSlave = _u8MBSlave;
+  MBTimeout tSavedTimeout = _tMBResponseTimeout;
+  uint16_t u16ScanTimeout, u16Elapsed;
+  uint32_t u32StartTime;
+  uint8_t u8Found = 0;
+  uint8_t u8Status;
+  uint16_t u16ID;
+#if __MODBUSMASTER_HEALTH__
+  ModbusErrorEvent *pErrorLog = _pErrorLog;
+  ModbusSlaveHealth *pHealth = _pHealth;
   
-  // assemble Modbus Request Application Data Unit
-  u8ModbusADU[u8ModbusADUSize++] = _u8MBSlave;
-  u8ModbusADU[u8ModbusADUSize++] = u8MBFunction;
+  // absent IDs are expected to time out; keep them out of the error log
+  _pErrorLog = 0;
+  _pHealth = 0;
+#endif
   
-  switch(u8MBFunction)
-  {
-    case ku8MBReadCoils:
-    case ku8MBReadDiscreteInputs:
-    case ku8MBReadInputRegisters:
-    case ku8MBReadHoldingRegisters:
-    case ku8MBReadWriteMultipleRegisters:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
-      break;
-  }
+  // urgent requests go first; the probes' short timeout must not apply 
+  // to them
+  serviceUrgent();
+  _u8UrgentHold++;
   
-  switch(u8MBFunction)
-  {
-    case ku8MBWriteSingleCoil:
-    case ku8MBMaskWriteRegister:
-    case ku8MBWriteMultipleCoils:
-    case ku8MBWriteSingleRegister:
-    case ku8MBWriteMultipleRegisters:
-    case ku8MBReadWriteMultipleRegisters:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteAddress);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteAddress);
-      break;
-  }
+  memset(pu8Map, 0, 32);
   
-  switch(u8MBFunction)
+  // 8-byte request + 8-byte echo, 11 bits per character, rounded up
+  u16ScanTimeout = (_u32BaudRate ? (176000UL + _u32BaudRate - 1) / _u32BaudRate : 
+    ku8MBResponseTimeout) + ku8MBScanTurnaround;
+  
+  for (u16ID = u8FirstID; u16ID <= u8LastID; u16ID++)
   {
-    case ku8MBWriteSingleCoil:
-      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
-      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
-      break;
-      
-    case ku8MBWriteSingleRegister:
+    // a late reply to the previous ID must not be taken for this one's
+    while (MBSerial.available())
+    {
+      MBSerial.read();
+    }
+    
+    _u8MBSlave = u16ID;
+    setTimeout(u16ScanTimeout);
+    u32StartTime = millis();
+    u8Status = diagnostics(ku16MBReturnQueryData, 0xA55A);
+    u16Elapsed = millis() - u32StartTime;
+    
+    if (u8Status < ku8MBInvalidSlaveID)
+    {
+      bitSet(pu8Map[u16ID >> 3], u16ID & 7);
+      u8Found++;
+      
+      // adapt to the slowest device seen so far
+      if (2 * u16Elapsed > u16ScanTimeout)
+      {
+        u16ScanTimeout = 2 * u16Elapsed;
+      }
+    }
+  }
+  
+  _u8MBSlave = u8SavedSlave;
+  _tMBResponseTimeout = tSavedTimeout;
+#if __MODBUSMASTER_HEALTH__
+  _pErrorLog = pErrorLog;
+  _pHealth = pHealth;
+#endif
+  _u8UrgentHold--;
+  return u8Found;
+}
+#endif
+
+
+#if __MODBUSMASTER_FILE__
+/**
+Modbus function 0x14 Read File Record.
+
+This function code is used to perform a file record read. A file is an 
+organization of records; each file contains 10000 records, addressed 
+0000 to 9999. Each record is one 16-bit register.
+
+The register data in the response buffer is packed as one word per 
+record register. A response that does not carry u16RecordQty registers 
+fails with ModbusMaster::ku8MBInvalidResponse.
+
+@param u16FileNumber file number (0x0001..0xFFFF)
+@param u16RecordNumber first record to read (0x0000..0x270F)
+@param u16RecordQty quantity of registers to read (1..121, enforced by remote device)
+@return 0 on success; exception number on failure
+@ingroup file
+*/
+uint8_t ModbusMaster::readFileRecord(uint16_t u16FileNumber,
+  uint16_t u16RecordNumber, uint16_t u16RecordQty)
+{
+  serviceUrgent();
+  _u16FileNumber = u16FileNumber;
+  _u16ReadAddress = u16RecordNumber;
+  _u16ReadQty = u16RecordQty;
+  return ModbusMasterTransaction(ku8MBReadFileRecord);
+}
+
+
+/**
+Modbus function 0x15 Write File Record.
+
+This function code is used to perform a file record write. The data to 
+be written is specified in the transmit buffer, packed as one word per 
+record register.
+
+@param u16FileNumber file number (0x0001..0xFFFF)
+@param u16RecordNumber first record to write (0x0000..0x270F)
+@param u16RecordQty quantity of registers to write (1..64)
+@return 0 on success; exception number on failure
+@ingroup file
+*/
+uint8_t ModbusMaster::writeFileRecord(uint16_t u16FileNumber,
+  uint16_t u16RecordNumber, uint16_t u16RecordQty)
+{
+  if (!_pfnRecordSource && u16RecordQty > ku8MaxBufferSize)
+  {
+    return ku8MBIllegalDataValue;
+  }
+  _u16FileNumber = u16FileNumber;
+  _u16WriteAddress = u16RecordNumber;
+  _u16WriteQty = u16RecordQty;
+  return ModbusMasterTransaction(ku8MBWriteFileRecord);
+}
+
+
+/**
+Stream a file from a remote device.
+
+Reads u16RecordQty registers starting at u16RecordNumber in chunks of 
+ModbusMaster::ku8MBFileChunkQty registers, the most a single Read File 
+Record response can carry (121), or fewer if the frame buffer 
+(__MODBUSMASTER_ADU_SIZE__) is smaller. Each chunk is handed to the sink 
+straight from the frame buffer; neither the response buffer nor any 
+other copy of the file is kept in RAM. A chunk returned short by the 
+slave is not passed to the sink and ends the transfer, so the sink never 
+sees a gap in the file.
+
+@param u16FileNumber file number (0x0001..0xFFFF)
+@param u16RecordNumber first record to read (0x0000..0x270F)
+@param u16RecordQty quantity of registers to read
+@param pfnSink callback receiving each chunk
+@return 0 on success; exception number of the first failed chunk
+@ingroup file
+*/
+uint8_t ModbusMaster::readFile(uint16_t u16FileNumber, uint16_t u16RecordNumber,
+  uint16_t u16RecordQty, MBRecordSink pfnSink)
+{
+  uint8_t u8Qty;
+  uint8_t u8MBStatus = ku8MBSuccess;
+  
+  while (u16RecordQty && !u8MBStatus)
+  {
+    // urgent requests may go between chunks, not while the sink is set
+    serviceUrgent();
+    _u8UrgentHold++;
+    _pfnRecordSink = pfnSink;
+    u8Qty = min(u16RecordQty, ku8MBFileChunkQty);
+    u8MBStatus = readFileRecord(u16FileNumber, u16RecordNumber, u8Qty);
+    _pfnRecordSink = 0;
+    _u8UrgentHold--;
+    u16RecordNumber += u8Qty;
+    u16RecordQty -= u8Qty;
+  }
+  return u8MBStatus;
+}
+
+
+/**
+Stream a file to a remote device.
+
+Writes u16RecordQty registers starting at u16RecordNumber in chunks of 
+ModbusMaster::ku8MBFileChunkQty registers. The source callback fills 
+each chunk directly into the request frame as it is assembled.
+
+@param u16FileNumber file number (0x0001..0xFFFF)
+@param u16RecordNumber first record to write (0x0000..0x270F)
+@param u16RecordQty quantity of registers to write
+@param pfnSource callback supplying each chunk
+@return 0 on success; exception number of the first failed chunk
+@ingroup file
+*/
+uint8_t ModbusMaster::writeFile(uint16_t u16FileNumber, uint16_t u16RecordNumber,
+  uint16_t u16RecordQty, MBRecordSource pfnSource)
+{
+  uint8_t u8Qty;
+  uint8_t u8MBStatus = ku8MBSuccess;
+  
+  while (u16RecordQty && !u8MBStatus)
+  {
+    // urgent requests may go between chunks, not while the source is set
+    serviceUrgent();
+    _u8UrgentHold++;
+    _pfnRecordSource = pfnSource;
+    u8Qty = min(u16RecordQty, ku8MBFileChunkQty);
+    u8MBStatus = writeFileRecord(u16FileNumber, u16RecordNumber, u8Qty);
+    _pfnRecordSource = 0;
+    _u8UrgentHold--;
+    u16RecordNumber += u8Qty;
+    u16RecordQty -= u8Qty;
+  }
+  return u8MBStatus;
+}
+
+
+/**
+Modbus function 0x18 Read FIFO Queue.
+
+This function code allows to read the contents of a First-In-First-Out 
+(FIFO) queue of registers in a remote device. The function returns a 
+count of the registers in the queue, followed by the queued data. Up to 
+31 queue data registers can be read.
+
+Word 0 of the response buffer holds the FIFO count; words 1..count hold 
+the queued registers.
+
+@param u16FifoAddress FIFO pointer address (0x0000..0xFFFF)
+@return 0 on success; exception number on failure
+@ingroup file
+*/
+uint8_t ModbusMaster::readFifoQueue(uint16_t u16FifoAddress)
+{
+  serviceUrgent();
+  _u16ReadAddress = u16FifoAddress;
+  return ModbusMasterTransaction(ku8MBReadFifoQueue);
+}
+#endif
+
+
+/**
+Execute a request descriptor.
+
+Loads the write data from pu16Data into the transmit buffer, conducts 
+the transaction with the request's slave, and copies the read data from 
+the response buffer back to pu16Data (coils/inputs packed 16 per word, 
+as in the response buffer). The result is also stored in u8Status.
+
+Register reads from a degraded slave (see setDegradeThreshold()) are 
+split into requests of ModbusMaster::ku8MBDegradedReadQty registers.
+
+@param pRequest request to execute
+@return 0 on success; ku8MBIllegalDataValue if the write data does not 
+fit the transmit buffer; ku8MBIllegalFunction if the function was left 
+out at compile time; exception number on failure
+@ingroup scan
+*/
+uint8_t ModbusMaster::execute(ModbusRequest *pRequest)
+{
+  uint8_t i, u8Qty;
+  uint8_t u8SavedSlave = _u8MBSlave;
+  uint16_t u16Offset = 0, u16Chunk = 0;
+  
+  if (writeWords(pRequest) > ku8MaxBufferSize)
+  {
+    pRequest->u8Status = ku8MBIllegalDataValue;
+    return pRequest->u8Status;
+  }
+  
+  if (!supported(pRequest->u8MBFunction))
+  {
+    pRequest->u8Status = ku8MBIllegalFunction;
+    return pRequest->u8Status;
+  }
+  
+  serviceUrgent();
+  load(pRequest);
+  _pActive = pRequest;
+#if __MODBUSMASTER_HEALTH__
+  // short frames are less likely to be hit by noise
+  if (isDegraded(pRequest->u8MBSlave) && pRequest->u16ReadQty > ku8MBDegradedReadQty &&
+    (pRequest->u8MBFunction == ku8MBReadHoldingRegisters ||
+    pRequest->u8MBFunction == ku8MBReadInputRegisters))
+  {
+    u16Chunk = ku8MBDegradedReadQty;
+    invalidate(pRequest);
+  }
+#endif
+  
+  do
+  {
+    if (u16Chunk)
+    {
+      _u16ReadAddress = pRequest->u16ReadAddress + u16Offset;
+      _u16ReadQty = min(u16Chunk, pRequest->u16ReadQty - u16Offset);
+    }
+    pRequest->u8Status = ModbusMasterTransaction(pRequest->u8MBFunction);
+    
+    if (pRequest->u8Status == ku8MBSuccess)
+    {
+      switch(pRequest->u8MBFunction)
+      {
+        case ku8MBReadCoils:
+        case ku8MBReadDiscreteInputs:
+          u8Qty = (_u16ReadQty + 15) >> 4;
+          break;
+          
+        case ku8MBReadHoldingRegisters:
+        case ku8MBReadInputRegisters:
+        case ku8MBReadWriteMultipleRegisters:
+          u8Qty = _u16ReadQty;
+          break;
+          
+        default:
+          u8Qty = 0;
+          break;
+      }
+      for (i = 0; pRequest->pu16Data && i < u8Qty && u16Offset + i < ku8MaxBufferSize; i++)
+      {
+        pRequest->pu16Data[u16Offset + i] = _u16ResponseBuffer[i];
+      }
+    }
+    u16Offset += _u16ReadQty;
+  } while (u16Chunk && pRequest->u8Status == ku8MBSuccess && u16Offset < pRequest->u16ReadQty);
+  _pActive = 0;
+  _u8MBSlave = u8SavedSlave;
+  
+  return pRequest->u8Status;
+}
+
+
+/**
+Enable preparing the next queued request ahead of time.
+
+When enabled, the transaction engine encodes the request poll() will 
+execute next (including its CRC) as soon as the current request has 
+been transmitted, while the slave is still processing it. Once the 
+response has arrived, the prepared frame is sent as soon as the t3.5 
+silent interval has elapsed, so the bus is idle only for the time the 
+protocol requires. Requests whose frame does not fit the 
+ModbusMaster::ku8MBPreparedADUSize byte staging buffer (large writes) 
+are encoded when executed, as before.
+
+Queued requests (and their write data) must not be modified once 
+submitted.
+
+@param u8Enable 0=disabled (default), non-zero=enabled
+@ingroup queue
+*/
+void ModbusMaster::setPrepareAhead(uint8_t u8Enable)
+{
+  _u8PrepareAhead = u8Enable;
+  _u8PreparedSize = 0;
+}
+
+
+/**
+Time to transmit a frame at the current baud rate.
+
+An RTU character is 11 bits long (start bit, 8 data bits, parity or 
+second stop bit, stop bit).
+
+@param u16Bytes frame size [bytes]
+@return transmission time [microseconds]
+@ingroup scan
+*/
+uint32_t ModbusMaster::frameTime(uint16_t u16Bytes)
+{
+  return _u32BaudRate ? (u16Bytes * 11000000UL) / _u32BaudRate : 0;
+}
+
+
+/**
+Minimum silent interval between frames (t3.5).
+
+3.5 character times; fixed at 1750 us for baud rates above 19200.
+
+@return inter-frame delay [microseconds]
+@ingroup scan
+*/
+uint32_t ModbusMaster::interFrameDelay()
+{
+  if (!_u32BaudRate || _u32BaudRate > 19200)
+  {
+    return 1750;
+  }
+  return 38500000UL / _u32BaudRate;
+}
+
+
+/**
+Planned duration of a request.
+
+Request and response frame times, an inter-frame delay after each 
+frame, and ModbusMaster::ku16MBTurnaroundBudget for the slave to reply.
+
+@param pRequest request to plan
+@return planned transaction time [microseconds]
+@ingroup scan
+*/
+uint32_t ModbusMaster::transactionTime(ModbusRequest *pRequest)
+{
+  return frameTime(requestSize(pRequest)) + frameTime(responseSize(pRequest)) +
+    2 * interFrameDelay() + ku16MBTurnaroundBudget;
+}
+
+
+#if __MODBUSMASTER_SCAN__
+/**
+Configure the cyclic scan.
+
+The requests are executed in order once per period by scan(). The scan 
+is planned from computed frame times; the table is rejected if the 
+planned duration does not fit the period. Statistics are cleared and 
+the first cycle is scheduled immediately. Call after begin().
+
+@param pTable requests to execute each cycle (0 to disable the scan)
+@param u8Count number of requests in pTable
+@param u32Period scan period [microseconds]
+@return 0 on success; ku8MBIllegalDataValue if the plan exceeds the period
+@ingroup scan
+*/
+uint8_t ModbusMaster::setScanTable(ModbusRequest *pTable, uint8_t u8Count,
+  uint32_t u32Period)
+{
+  uint8_t i;
+  uint32_t u32Planned = 0;
+  
+  for (i = 0; i < u8Count; i++)
+  {
+    u32Planned += transactionTime(&pTable[i]);
+  }
+  if (u32Planned > u32Period)
+  {
+    return ku8MBIllegalDataValue;
+  }
+  
+  _pScanTable = pTable;
+  _u8ScanCount = u8Count;
+  _u32ScanPeriod = u32Period;
+  clearScanStats();
+  _ScanStats.u32PlannedDuration = u32Planned;
+  _u32ScanNext = micros();
+  return ku8MBSuccess;
+}
+
+
+/**
+Execute one cycle of the scan table.
+
+Returns at once if the next cycle is not due yet; otherwise executes 
+every request in order. Each request is bounded by a response timeout derived 
+from its planned response time rather than the general timeout, so a 
+missing slave cannot stretch the cycle beyond its plan by more than a 
+few milliseconds. A cycle that runs past the period is counted as an 
+overrun and the missed start times are skipped, keeping later cycles 
+aligned to the original schedule. Call repeatedly from loop(); the 
+sketch keeps running between cycles.
+
+@return 0 if all requests succeeded or the cycle is not due yet; otherwise 
+status of the first failed request
+@ingroup scan
+*/
+uint8_t ModbusMaster::scan()
+{
+  uint8_t i;
+  uint8_t u8MBStatus = ku8MBSuccess;
+  MBTimeout tSavedTimeout = _tMBResponseTimeout;
+  uint32_t u32Start, u32Elapsed;
+  
+  if (!_pScanTable || (int32_t)(micros() - _u32ScanNext) < 0)
+  {
+    return ku8MBSuccess;
+  }
+  u32Start = micros();
+  
+  for (i = 0; i < _u8ScanCount; i++)
+  {
+    // urgent requests go first, with the regular response timeout
+    serviceUrgent();
+#if __MODBUSMASTER_HEALTH__
+    // poll a degraded slave less often
+    if (isDegraded(_pScanTable[i].u8MBSlave) && _ScanStats.u32Cycles % ku8MBDegradedScanDivider)
+    {
+      continue;
+    }
+#endif
+    setTimeout((frameTime(responseSize(&_pScanTable[i])) + 
+      ku16MBTurnaroundBudget) / 1000 + 2);
+    _u8UrgentHold++;
+    if (execute(&_pScanTable[i]) && !u8MBStatus)
+    {
+      u8MBStatus = _pScanTable[i].u8Status;
+    }
+    _u8UrgentHold--;
+    _tMBResponseTimeout = tSavedTimeout;
+  }
+  
+  // record statistics
+  u32Elapsed = micros() - u32Start;
+  _ScanStats.u32LastJitter = u32Start - _u32ScanNext;
+  _ScanStats.u32LastDuration = u32Elapsed;
+  if (_ScanStats.u32LastJitter > _ScanStats.u32MaxJitter)
+  {
+    _ScanStats.u32MaxJitter = _ScanStats.u32LastJitter;
+  }
+  if (u32Elapsed < _ScanStats.u32MinDuration)
+  {
+    _ScanStats.u32MinDuration = u32Elapsed;
+  }
+  if (u32Elapsed > _ScanStats.u32MaxDuration)
+  {
+    _ScanStats.u32MaxDuration = u32Elapsed;
+  }
+  _ScanStats.u32Cycles++;
+  
+  // schedule next cycle; skip start times already missed
+  _u32ScanNext += _u32ScanPeriod;
+  if ((int32_t)(micros() - _u32ScanNext) > 0)
+  {
+    _ScanStats.u32Overruns++;
+    do
+    {
+      _u32ScanNext += _u32ScanPeriod;
+    } while ((int32_t)(micros() - _u32ScanNext) > 0);
+  }
+  return u8MBStatus;
+}
+
+
+/**
+Retrieve cyclic scan timing statistics.
+
+@param pStats destination for a copy of the statistics
+@ingroup scan
+*/
+void ModbusMaster::getScanStats(ModbusScanStats *pStats)
+{
+  *pStats = _ScanStats;
+}
+
+
+/**
+Clear cyclic scan timing statistics.
+
+The planned duration is kept.
+
+@ingroup scan
+*/
+void ModbusMaster::clearScanStats()
+{
+  uint32_t u32Planned = _ScanStats.u32PlannedDuration;
+  
+  memset(&_ScanStats, 0, sizeof(_ScanStats));
+  _ScanStats.u32PlannedDuration = u32Planned;
+  _ScanStats.u32MinDuration = 0xFFFFFFFF;
+}
+#endif
+
+
+#if __MODBUSMASTER_CAPTURE__
+/**
+Enable capture of bus traffic.
+
+Every request and response frame is recorded with a microsecond 
+timestamp and its status into a ring buffer supplied by the caller. 
+Each record costs 7 bytes plus the frame; when the ring is full the 
+oldest records are overwritten (see getCaptureDropped()). Nothing is 
+captured, and no time is spent, while capture is disabled.
+
+Record layout (little-endian): timestamp [micros(), 4 bytes], direction 
+(ku8MBCaptureTX/ku8MBCaptureRX), status (RX: transaction result), frame 
+length, frame bytes.
+
+@param pu8Buffer ring buffer storage (0 to disable capture)
+@param u16Size size of pu8Buffer [bytes]
+@ingroup capture
+*/
+void ModbusMaster::setCapture(uint8_t *pu8Buffer, uint16_t u16Size)
+{
+  _pu8Capture = pu8Buffer;
+  _u16CaptureSize = u16Size;
+  clearCapture();
+}
+
+
+/**
+Discard all captured records.
+
+@ingroup capture
+*/
+void ModbusMaster::clearCapture()
+{
+  _u16CaptureTail = 0;
+  _u16CaptureUsed = 0;
+  _u32CaptureDropped = 0;
+}
+
+
+/**
+Number of records overwritten since the capture was last cleared.
+
+@return dropped record count
+@ingroup capture
+*/
+uint32_t ModbusMaster::getCaptureDropped()
+{
+  return _u32CaptureDropped;
+}
+
+
+/**
+Write captured traffic as a pcap file and clear the capture.
+
+The output is a complete pcap (v2.4) file with link type 
+ModbusMaster::ku8MBCaptureLinkType, one packet per frame, and can be 
+written to a spare serial port or a file (e.g. SD library File). 
+Request and response status is not part of pcap; timed out responses 
+appear as short or empty packets, corrupted ones fail the CRC check in 
+the dissector.
+
+@param out destination stream
+@ingroup capture
+*/
+void ModbusMaster::dumpCapture(Print &out)
+{
+  uint8_t u8Header[24] = 
+  {
+    0xD4, 0xC3, 0xB2, 0xA1,  // magic, microsecond timestamps
+    0x02, 0x00, 0x04, 0x00,  // version 2.4
+    0x00, 0x00, 0x00, 0x00,  // GMT offset
+    0x00, 0x00, 0x00, 0x00,  // timestamp accuracy
+    0x00, 0x01, 0x00, 0x00,  // snapshot length 256
+    ku8MBCaptureLinkType, 0x00, 0x00, 0x00
+  };
+  uint8_t i, u8Size;
+  uint32_t u32Time, u32Field;
+  
+  out.write(u8Header, sizeof(u8Header));
+  
+  while (_pu8Capture && _u16CaptureUsed)
+  {
+    u32Time = 0;
+    for (i = 0; i < 4; i++)
+    {
+      u32Time |= (uint32_t)captureByte(i) << (8 * i);
+    }
+    u8Size = captureByte(6);
+    
+    // record header: seconds, microseconds, captured length, original length
+    for (i = 0; i < 16; i++)
+    {
+      switch(i >> 2)
+      {
+        case 0:  u32Field = u32Time / 1000000UL; break;
+        case 1:  u32Field = u32Time % 1000000UL; break;
+        default: u32Field = u8Size;              break;
+      }
+      out.write((uint8_t)(u32Field >> (8 * (i & 3))));
+    }
+    for (i = 0; i < u8Size; i++)
+    {
+      out.write(captureByte(7 + i));
+    }
+    
+    _u16CaptureTail = (_u16CaptureTail + 7 + u8Size) % _u16CaptureSize;
+    _u16CaptureUsed -= 7 + u8Size;
+  }
+  clearCapture();
+}
+#endif
+
+
+#if __MODBUSMASTER_HEALTH__
+/**
+Enable the error log.
+
+Every transaction that does not succeed (exception response, timeout, 
+CRC error, ...) is recorded into a ring of events supplied by the 
+caller; when the ring is full the oldest event is overwritten. Nothing 
+is allocated.
+
+@param pLog event ring storage (0 to disable the log)
+@param u8Size number of events in pLog
+@ingroup health
+*/
+void ModbusMaster::setErrorLog(ModbusErrorEvent *pLog, uint8_t u8Size)
+{
+  _pErrorLog = u8Size ? pLog : 0;
+  _u8ErrorLogSize = u8Size;
+  clearErrorLog();
+}
+
+
+/**
+Retrieve the number of events held in the error log.
+
+@return number of events (0..size of the ring)
+@ingroup health
+*/
+uint8_t ModbusMaster::getErrorCount()
+{
+  return _u8ErrorLogCount;
+}
+
+
+/**
+Retrieve an event from the error log.
+
+@param u8Index event to retrieve (0 = most recent)
+@param pEvent destination for a copy of the event
+@return 0 on success; ku8MBIllegalDataAddress if the log holds no such event
+@ingroup health
+*/
+uint8_t ModbusMaster::getErrorEvent(uint8_t u8Index, ModbusErrorEvent *pEvent)
+{
+  if (u8Index < _u8ErrorLogCount)
+  {
+    *pEvent = _pErrorLog[(_u8ErrorLogHead + _u8ErrorLogSize - 1 - u8Index) % _u8ErrorLogSize];
+    return ku8MBSuccess;
+  }
+  else
+  {
+    return ku8MBIllegalDataAddress;
+  }
+}
+
+
+/**
+Discard all events in the error log.
+
+@ingroup health
+*/
+void ModbusMaster::clearErrorLog()
+{
+  _u8ErrorLogHead = 0;
+  _u8ErrorLogCount = 0;
+}
+
+
+/**
+Enable slave health tracking.
+
+The table holds one entry per slave ID from u8FirstSlave on, so a 
+slave's health is found by a subtraction; it is updated after every 
+transaction with a slave in the table and cleared here.
+
+@param pTable health table storage (0 to disable tracking)
+@param u8FirstSlave slave ID of the first entry (0..255)
+@param u8Count number of entries in pTable
+@ingroup health
+*/
+void ModbusMaster::setHealthTable(ModbusSlaveHealth *pTable, uint8_t u8FirstSlave,
+  uint8_t u8Count)
+{
+  _pHealth = pTable;
+  _u8HealthFirst = u8FirstSlave;
+  _u8HealthCount = u8Count;
+  if (_pHealth)
+  {
+    memset(_pHealth, 0, u8Count * sizeof(ModbusSlaveHealth));
+  }
+}
+
+
+/**
+Set the error rate at which a slave is degraded.
+
+A degraded slave is read with requests of at most 
+ModbusMaster::ku8MBDegradedReadQty registers by execute(), the queue and 
+the cyclic scan, and is polled only every 
+ModbusMaster::ku8MBDegradedScanDivider-th scan cycle. It recovers once 
+its error rate has fallen below half the threshold.
+
+@param u16PerMille error rate threshold [1/1000] (1..1000; 0 = never degrade)
+@ingroup health
+*/
+void ModbusMaster::setDegradeThreshold(uint16_t u16PerMille)
+{
+  _u16DegradeThreshold = min(((uint32_t)u16PerMille << 16) / 1000, 0xFFFFUL);
+}
+
+
+/**
+Retrieve the error rate of a slave.
+
+@param u8MBSlave slave ID
+@return moving average error rate [1/1000]; 0 if the slave is not in the 
+health table
+@ingroup health
+*/
+uint16_t ModbusMaster::getErrorRate(uint8_t u8MBSlave)
+{
+  ModbusSlaveHealth *pHealth = health(u8MBSlave);
+  
+  return pHealth ? ((uint32_t)pHealth->u16ErrorRate * 1000) >> 16 : 0;
+}
+
+
+/**
+Check whether a slave is degraded.
+
+@param u8MBSlave slave ID
+@return 1 if degraded; 0 otherwise, or if the slave is not in the health table
+@ingroup health
+*/
+uint8_t ModbusMaster::isDegraded(uint8_t u8MBSlave)
+{
+  ModbusSlaveHealth *pHealth = health(u8MBSlave);
+  
+  return pHealth ? pHealth->u8Degraded : 0;
+}
+#endif
+
+
+/**
+Queue a request for execution by poll().
+
+The request is linked into the queue in place (no copy, no allocation); 
+it and its data must stay valid until its completion callback has run. 
+A request is recognized as already queued by its link in the queue, not 
+by its status, so a new request need not be initialized beyond its 
+fields. Once poll() has taken it from the queue it must not be submitted 
+again before its completion callback has run. Safe to call from an 
+interrupt handler.
+
+@param pRequest request to queue; u8Status is set to ku8MBRequestPending
+@return 0 on success; ku8MBRequestPending if the request is already queued; 
+ku8MBIllegalDataValue if its write data does not fit the transmit buffer 
+(the request is not queued)
+@ingroup queue
+*/
+uint8_t ModbusMaster::submit(ModbusRequest *pRequest)
+{
+  ModbusRequest **ppLink;
+  uint8_t u8SREG = SREG;
+  
+  if (writeWords(pRequest) > ku8MaxBufferSize)
+  {
+    return ku8MBIllegalDataValue;
+  }
+  
+  cli();
+  for (ppLink = &_pQueue; *ppLink; ppLink = &(*ppLink)->pNext)
+  {
+    if (*ppLink == pRequest)
+    {
+      SREG = u8SREG;
+      return ku8MBRequestPending;
+    }
+  }
+  pRequest->u8Status = ku8MBRequestPending;
+  pRequest->u32Submitted = micros();
+  pRequest->pNext = 0;
+  *ppLink = pRequest;
+  if (pRequest->u8Priority >= ku8MBPriorityUrgent)
+  {
+    _u8UrgentPending++;
+  }
+  SREG = u8SREG;
+  return ku8MBSuccess;
+}
+
+
+/**
+Execute the next queued request.
+
+Arbitration picks the highest priority first; among equal priorities the 
+node served least recently wins, so a node with many queued requests 
+cannot starve the others; remaining ties go in submission order. The 
+request is executed, then its completion callback is invoked. Call 
+repeatedly from loop() to keep the bus busy.
+
+@return number of requests still queued
+@ingroup queue
+*/
+uint8_t ModbusMaster::poll()
+{
+  ModbusRequest *pRequest = dequeue(ku8MBPriorityLow);
+  
+  if (pRequest)
+  {
+    dispatch(pRequest);
+  }
+  return pending();
+}
+
+
+/**
+Number of queued requests.
+
+@return requests waiting for poll()
+@ingroup queue
+*/
+uint8_t ModbusMaster::pending()
+{
+  ModbusRequest *pRequest;
+  uint8_t u8Count = 0;
+  uint8_t u8SREG = SREG;
+  
+  cli();
+  for (pRequest = _pQueue; pRequest; pRequest = pRequest->pNext)
+  {
+    u8Count++;
+  }
+  SREG = u8SREG;
+  return u8Count;
+}
+
+
+/**
+Discard the staged frame of a queued request.
+
+A request encoded ahead of time (see setPrepareAhead()) would otherwise 
+be sent as it was when it was staged. Call after changing the slave, 
+addresses, quantities or data of a request that is still queued.
+
+@param pRequest queued request that has been changed
+@ingroup queue
+*/
+void ModbusMaster::invalidate(ModbusRequest *pRequest)
+{
+  if (_pPrepared == pRequest)
+  {
+    _u8PreparedSize = 0;
+  }
+}
+
+
+/**
+Worst-case delay before an urgent request submitted now is transmitted.
+
+The transaction in progress may last until its request frame has been 
+sent, the response timeout has expired and t3.5 has passed; each urgent 
+request already queued may take as long again. With no transaction in 
+progress the bound is t3.5, assuming poll() is called promptly. Urgent 
+requests wait for request boundaries: a blocking call that sends the 
+transmit buffer, a discovery or link negotiation started meanwhile is 
+not covered by the bound. Scan entries use shorter timeouts, so the 
+bound is conservative while scanning.
+
+@return latency bound [microseconds]
+@ingroup queue
+*/
+uint32_t ModbusMaster::urgentLatencyBound()
+{
+  ModbusRequest *pRequest;
+  uint32_t u32Bound, u32Elapsed;
+  uint32_t u32Timeout = (_tMBResponseTimeout + 1UL) * 1000UL;
+  uint8_t u8SREG = SREG;
+  
+  u32Bound = interFrameDelay();
+  if (_u8FrameSize)
+  {
+    u32Bound += frameTime(_u8FrameSize) + u32Timeout;
+    u32Elapsed = micros() - _u32FrameStart;
+    u32Bound = (u32Elapsed < u32Bound) ? u32Bound - u32Elapsed : 0;
+  }
+  
+  cli();
+  for (pRequest = _pQueue; pRequest; pRequest = pRequest->pNext)
+  {
+    if (pRequest->u8Priority >= ku8MBPriorityUrgent)
+    {
+      u32Bound += frameTime(requestSize(pRequest)) + u32Timeout + interFrameDelay();
+    }
+  }
+  SREG = u8SREG;
+  return u32Bound;
+}
+
+
+/**
+Retrieve queue latency statistics.
+
+@param u8Priority priority class (ku8MBPriorityLow..ku8MBPriorityUrgent)
+@param pStats destination
+@ingroup queue
+*/
+void ModbusMaster::getLatencyStats(uint8_t u8Priority, ModbusLatencyStats *pStats)
+{
+  *pStats = _LatencyStats[min(u8Priority, ku8MBPriorityUrgent)];
+}
+
+
+/**
+Estimate a latency percentile from the histogram of a priority class.
+
+@param u8Priority priority class (ku8MBPriorityLow..ku8MBPriorityUrgent)
+@param u8Percent percentile (1..100), e.g. 99 for the 99th percentile
+@return upper bound of the latency class holding the percentile, capped 
+at the longest latency seen; 0 if nothing has completed [microseconds]
+@ingroup queue
+*/
+uint32_t ModbusMaster::getLatencyPercentile(uint8_t u8Priority, uint8_t u8Percent)
+{
+  ModbusLatencyStats *pStats = &_LatencyStats[min(u8Priority, ku8MBPriorityUrgent)];
+  uint32_t u32Total = 0, u32Sum = 0;
+  uint8_t i;
+  
+  for (i = 0; i < 16; i++)
+  {
+    u32Total += pStats->u16Histogram[i];
+  }
+  for (i = 0; i < 15; i++)
+  {
+    u32Sum += pStats->u16Histogram[i];
+    if (u32Sum && u32Sum * 100 >= u32Total * u8Percent)
+    {
+      return min(1UL << (i + 10), pStats->u32Max);
+    }
+  }
+  return pStats->u32Max;
+}
+
+
+/**
+Clear queue latency statistics of all priority classes.
+
+@ingroup queue
+*/
+void ModbusMaster::clearLatencyStats()
+{
+  memset(_LatencyStats, 0, sizeof(_LatencyStats));
+}
+
+
+/**
+Constructor.
+
+Creates a handle for a slave on a shared bus.
+
+@param mbBus bus the slave is attached to
+@param u8MBSlave Modbus slave ID (1..255)
+@ingroup queue
+*/
+ModbusNode::ModbusNode(ModbusMaster &mbBus, uint8_t u8MBSlave)
+{
+  _pBus = &mbBus;
+  _u8MBSlave = u8MBSlave;
+  _u16LastServed = 0;
+  _u8Fusion = 0;
+}
+
+
+/**
+Queue a request for this node's slave.
+
+@see ModbusMaster::submit()
+@param pRequest request to queue; u8MBSlave and pNode are filled in
+@return 0 on success; ku8MBRequestPending if the request is already queued
+@ingroup queue
+*/
+uint8_t ModbusNode::submit(ModbusRequest *pRequest)
+{
+  pRequest->u8MBSlave = _u8MBSlave;
+  pRequest->pNode = this;
+  return _pBus->submit(pRequest);
+}
+
+
+/**
+Execute a request for this node's slave immediately, bypassing the 
+queue. Must not be called from a completion callback or interrupt.
+
+@param pRequest request to execute; u8MBSlave is filled in
+@return 0 on success; exception number on failure
+@ingroup queue
+*/
+uint8_t ModbusNode::execute(ModbusRequest *pRequest)
+{
+  pRequest->u8MBSlave = _u8MBSlave;
+  return _pBus->execute(pRequest);
+}
+
+
+/**
+Enable request fusion for this node's slave.
+
+When the request the queue would serve after a Write Multiple Registers 
+request of this node, taking the priorities and round-robin of all 
+nodes into account, is a Read Holding Registers request of the same 
+node, both are sent as a single Read/Write Multiple Registers (0x17) 
+request, saving a round trip and a slave turnaround. A read waiting 
+behind requests of other nodes is not fused. The slave writes before it reads, so the 
+read sees the written values as it would have otherwise. Each request 
+gets its own status and completion callback.
+
+If the slave answers the fused request with an exception response, both 
+requests are executed on their own, so each gets its own status. On 
+ku8MBIllegalFunction, fusion is also disabled again.
+
+Has no effect if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__ is 0.
+
+@param u8Enable 1 if the slave supports function 0x17; 0 to disable fusion
+@ingroup queue
+*/
+void ModbusNode::setFusion(uint8_t u8Enable)
+{
+  _u8Fusion = u8Enable;
+}
+
+
+/**
+Check whether request fusion is enabled for this node's slave.
+
+@return 1 if enabled; 0 if disabled, or if the slave lacks function 0x17
+@ingroup queue
+*/
+uint8_t ModbusNode::getFusion()
+{
+  return _u8Fusion;
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Load a request descriptor into the transaction members.
+
+Sets the slave, addresses and quantities, and copies the write data 
+into the transmit buffer.
+
+@param pRequest request to load
+*/
+void ModbusMaster::load(ModbusRequest *pRequest)
+{
+  uint16_t i, u16Qty = writeWords(pRequest);
+  
+  _u8MBSlave = pRequest->u8MBSlave;
+  _u16ReadAddress = pRequest->u16ReadAddress;
+  _u16ReadQty = pRequest->u16ReadQty;
+  _u16WriteAddress = pRequest->u16WriteAddress;
+  _u16WriteQty = pRequest->u16WriteQty;
+  if (pRequest->u8MBFunction == ku8MBWriteSingleCoil)
+  {
+    _u16WriteQty = (pRequest->u16WriteQty ? 0xFF00 : 0x0000);
+  }
+  
+  for (i = 0; pRequest->pu16Data && i < u16Qty && i < ku8MaxBufferSize; i++)
+  {
+    _u16TransmitBuffer[i] = pRequest->pu16Data[i];
+  }
+}
+
+
+/**
+Quantity of write data words a request descriptor carries in pu16Data.
+
+@param pRequest request to size
+@return words loaded into the transmit buffer (coils packed 16 per word)
+*/
+uint16_t ModbusMaster::writeWords(ModbusRequest *pRequest)
+{
+  return writeWords(pRequest->u8MBFunction, pRequest->u16WriteQty);
+}
+
+
+/**
+Quantity of transmit buffer words a function and write quantity use.
+
+@param u8MBFunction Modbus function
+@param u16WriteQty quantity of registers/coils to write
+@return words taken from the transmit buffer (coils packed 16 per word)
+*/
+uint16_t ModbusMaster::writeWords(uint8_t u8MBFunction, uint16_t u16WriteQty)
+{
+  switch(u8MBFunction)
+  {
+    case ku8MBWriteSingleRegister:
+      return 1;
+      
+    case ku8MBMaskWriteRegister:
+      return 2;
+      
+    case ku8MBWriteMultipleCoils:
+      return (u16WriteQty + 15) >> 4;
+      
+    case ku8MBWriteMultipleRegisters:
+    case ku8MBReadWriteMultipleRegisters:
+      return u16WriteQty;
+      
+    default:
+      return 0;
+  }
+}
+
+
+/**
+Check whether a function was compiled in.
+
+@param u8MBFunction Modbus function
+@return 0 if the function was left out by its __MODBUSMASTER_..._ switch; 
+1 otherwise
+*/
+uint8_t ModbusMaster::supported(uint8_t u8MBFunction)
+{
+  switch(u8MBFunction)
+  {
+    default:
+      return 1;
+      
+#if !__MODBUSMASTER_READ_COILS__
+    case ku8MBReadCoils:
+#endif
+#if !__MODBUSMASTER_READ_DISCRETE_INPUTS__
+    case ku8MBReadDiscreteInputs:
+#endif
+#if !__MODBUSMASTER_READ_HOLDING_REGISTERS__
+    case ku8MBReadHoldingRegisters:
+#endif
+#if !__MODBUSMASTER_READ_INPUT_REGISTERS__
+    case ku8MBReadInputRegisters:
+#endif
+#if !__MODBUSMASTER_WRITE_SINGLE_COIL__
+    case ku8MBWriteSingleCoil:
+#endif
+#if !__MODBUSMASTER_WRITE_SINGLE_REGISTER__
+    case ku8MBWriteSingleRegister:
+#endif
+#if !__MODBUSMASTER_WRITE_MULTIPLE_COILS__
+    case ku8MBWriteMultipleCoils:
+#endif
+#if !__MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
+    case ku8MBWriteMultipleRegisters:
+#endif
+#if !__MODBUSMASTER_MASK_WRITE_REGISTER__
+    case ku8MBMaskWriteRegister:
+#endif
+#if !__MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+    case ku8MBReadWriteMultipleRegisters:
+#endif
+#if !__MODBUSMASTER_DIAGNOSTIC__
+    case ku8MBDiagnostics:
+    case ku8MBEncapsulatedInterface:
+#endif
+#if !__MODBUSMASTER_FILE__
+    case ku8MBReadFileRecord:
+    case ku8MBWriteFileRecord:
+    case ku8MBReadFifoQueue:
+#endif
+      return 0;
+  }
+}
+
+
+/**
+Encode the next queued request into the staging buffer.
+
+Called while a response is outstanding. The slave, address and quantity 
+members still belong to the transaction in progress, so they are saved 
+around the encoding.
+*/
+void ModbusMaster::prepareNext()
+{
+  ModbusRequest **ppNext;
+  ModbusRequest *pNext = 0;
+  uint8_t u8SavedSlave = _u8MBSlave;
+  uint16_t u16ReadAddress = _u16ReadAddress, u16ReadQty = _u16ReadQty;
+  uint16_t u16WriteAddress = _u16WriteAddress, u16WriteQty = _u16WriteQty;
+  uint8_t u8SREG = SREG;
+  
+  cli();
+  ppNext = selectRequest();
+  if (ppNext)
+  {
+    pNext = *ppNext;
+  }
+  SREG = u8SREG;
+  
+  if (!pNext || requestSize(pNext) >= ku8MBPreparedADUSize)
+  {
+    return;
+  }
+  
+  load(pNext);
+  _u8PreparedSize = assembleADU(_u8PreparedADU, pNext->u8MBFunction);
+  _pPrepared = pNext;
+  
+  _u8MBSlave = u8SavedSlave;
+  _u16ReadAddress = u16ReadAddress;
+  _u16ReadQty = u16ReadQty;
+  _u16WriteAddress = u16WriteAddress;
+  _u16WriteQty = u16WriteQty;
+}
+
+
+/**
+Select the request poll() executes next.
+
+Must be called with interrupts disabled.
+
+@return link to the selected request; 0 if the queue is empty
+*/
+ModbusRequest **ModbusMaster::selectRequest()
+{
+  ModbusRequest **ppLink, **ppBest = 0;
+  ModbusRequest *pRequest;
+  uint16_t u16Age, u16BestAge = 0;
+  
+  for (ppLink = &_pQueue; *ppLink; ppLink = &(*ppLink)->pNext)
+  {
+    pRequest = *ppLink;
+    u16Age = pRequest->pNode ? _u16ServiceSeq - pRequest->pNode->_u16LastServed : 0xFFFF;
+    if (!ppBest || pRequest->u8Priority > (*ppBest)->u8Priority ||
+      (pRequest->u8Priority == (*ppBest)->u8Priority && u16Age > u16BestAge))
+    {
+      ppBest = ppLink;
+      u16BestAge = u16Age;
+    }
+  }
+  return ppBest;
+}
+
+
+/**
+Remove the request poll() executes next from the queue.
+
+@param u8MinPriority lowest priority to accept
+@return request removed; 0 if the queue holds none of that priority
+*/
+ModbusRequest *ModbusMaster::dequeue(uint8_t u8MinPriority)
+{
+  ModbusRequest **ppBest;
+  ModbusRequest *pRequest = 0;
+  uint8_t u8SREG = SREG;
+  
+  cli();
+  ppBest = selectRequest();
+  if (ppBest && (*ppBest)->u8Priority >= u8MinPriority)
+  {
+    pRequest = *ppBest;
+    *ppBest = pRequest->pNext;
+    if (pRequest->u8Priority >= ku8MBPriorityUrgent)
+    {
+      _u8UrgentPending--;
+    }
+  }
+  SREG = u8SREG;
+  return pRequest;
+}
+
+
+/**
+Execute a request taken from the queue, fused with the read following it 
+if possible (see ModbusNode::setFusion()).
+
+@param pRequest request removed from the queue
+*/
+void ModbusMaster::dispatch(ModbusRequest *pRequest)
+{
+  ModbusRequest *pRead = 0;
+  
+  if (pRequest->pNode)
+  {
+    pRequest->pNode->_u16LastServed = ++_u16ServiceSeq;
+  }
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+  pRead = fusible(pRequest);
+#endif
+  
+  if (!pRead)
+  {
+    execute(pRequest);
+  }
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+  else if (fuse(pRequest, pRead))
+  {
+    execute(pRequest);
+    execute(pRead);
+  }
+#endif
+  
+  complete(pRequest);
+  if (pRead)
+  {
+    complete(pRead);
+  }
+}
+
+
+/**
+Record the latency of an executed queued request, then invoke its 
+completion callback.
+
+@param pRequest request executed
+*/
+void ModbusMaster::complete(ModbusRequest *pRequest)
+{
+  ModbusLatencyStats *pStats;
+  uint32_t u32Latency;
+  uint8_t u8Class;
+  
+  u32Latency = micros() - pRequest->u32Submitted;
+  pStats = &_LatencyStats[min(pRequest->u8Priority, ku8MBPriorityUrgent)];
+  pStats->u32Count++;
+  if (u32Latency > pStats->u32Max)
+  {
+    pStats->u32Max = u32Latency;
+  }
+  for (u8Class = 0; (u32Latency >> 10) && u8Class < 15; u8Class++)
+  {
+    u32Latency >>= 1;
+  }
+  if (pStats->u16Histogram[u8Class] < 0xFFFF)
+  {
+    pStats->u16Histogram[u8Class]++;
+  }
+  
+  if (pRequest->pfnComplete)
+  {
+    pRequest->pfnComplete(pRequest);
+  }
+}
+
+
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+/**
+Find the read to fuse with a write taken from the queue, and remove it 
+from the queue.
+
+The read must be the request the queue would serve next once the write 
+has been served, over all nodes: no other queued request has a higher 
+priority, or the same priority and a node waiting longer. Fusion thus 
+never lets a request overtake another.
+
+@param pWrite request removed from the queue, its node marked as served
+@return read to fuse; 0 if there is none
+*/
+ModbusRequest *ModbusMaster::fusible(ModbusRequest *pWrite)
+{
+  ModbusRequest **ppNext;
+  ModbusRequest *pRead = 0;
+  uint8_t u8SREG;
+  
+  if (pWrite->u8MBFunction != ku8MBWriteMultipleRegisters || !pWrite->pNode ||
+    !pWrite->pNode->_u8Fusion || pWrite->u16WriteQty > ku8MBMaxFusedWriteQty)
+  {
+    return 0;
+  }
+#if __MODBUSMASTER_HEALTH__
+  // a degraded slave gets short frames
+  if (isDegraded(pWrite->u8MBSlave))
+  {
+    return 0;
+  }
+#endif
+  
+  u8SREG = SREG;
+  cli();
+  ppNext = selectRequest();
+  if (ppNext && (*ppNext)->pNode == pWrite->pNode &&
+    (*ppNext)->u8MBFunction == ku8MBReadHoldingRegisters &&
+    (*ppNext)->u16ReadQty <= ku8MBMaxFusedReadQty)
+  {
+    pRead = *ppNext;
+    *ppNext = pRead->pNext;
+    if (pRead->u8Priority >= ku8MBPriorityUrgent)
+    {
+      _u8UrgentPending--;
+    }
+  }
+  SREG = u8SREG;
+  return pRead;
+}
+
+
+/**
+Execute a write and a read as one Read/Write Multiple Registers request.
+
+If the slave answers with an exception response, neither request's 
+status is set: the exception may concern either half, so the caller 
+executes both on their own. On ku8MBIllegalFunction, fusion is also 
+disabled for the node. Any other result, e.g. a timeout, is stored in 
+both requests.
+
+@param pWrite Write Multiple Registers request
+@param pRead Read Holding Registers request for the same slave
+@return 0 if both requests were completed; the slave's exception code 
+if it rejected the fused request
+*/
+uint8_t ModbusMaster::fuse(ModbusRequest *pWrite, ModbusRequest *pRead)
+{
+  uint8_t i, u8MBStatus;
+  uint8_t u8SavedSlave = _u8MBSlave;
+  
+  invalidate(pWrite);
+  load(pWrite);
+  _u16ReadAddress = pRead->u16ReadAddress;
+  _u16ReadQty = pRead->u16ReadQty;
+  _pActive = pWrite;
+  u8MBStatus = ModbusMasterTransaction(ku8MBReadWriteMultipleRegisters);
+  _pActive = 0;
+  _u8MBSlave = u8SavedSlave;
+  
+  if (u8MBStatus && u8MBStatus < ku8MBInvalidSlaveID)
+  {
+    if (u8MBStatus == ku8MBIllegalFunction)
+    {
+      pWrite->pNode->_u8Fusion = 0;
+    }
+    return u8MBStatus;
+  }
+  
+  pWrite->u8Status = u8MBStatus;
+  pRead->u8Status = u8MBStatus;
+  for (i = 0; !u8MBStatus && pRead->pu16Data && i < pRead->u16ReadQty && i < ku8MaxBufferSize; i++)
+  {
+    pRead->pu16Data[i] = _u16ResponseBuffer[i];
+  }
+  return 0;
+}
+#endif
+
+
+/**
+Execute the queued urgent requests at a request boundary.
+
+Called before a request is set up, so no transaction state has to be 
+saved. Does nothing while urgent requests are held (_u8UrgentHold), 
+i.e. while a composite call is in progress or the urgent requests 
+themselves are being executed; the transaction engine is never entered 
+twice.
+*/
+void ModbusMaster::serviceUrgent()
+{
+  ModbusRequest *pRequest;
+  
+  if (!_u8UrgentPending || _u8UrgentHold)
+  {
+    return;
+  }
+  
+  _u8UrgentHold++;
+  while ((pRequest = dequeue(ku8MBPriorityUrgent)))
+  {
+    dispatch(pRequest);
+  }
+  _u8UrgentHold--;
+}
+
+
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__ && __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+/**
+Switch the serial port to a link setting.
+
+Waits ModbusMaster::ku8MBLinkSettleTime for the slaves to follow, then 
+discards anything received meanwhile. The response timeout is fitted to 
+a probe at the new baud rate.
+
+@param pSetting setting to switch to
+*/
+void ModbusMaster::setLink(const ModbusLinkSetting *pSetting)
+{
+  begin(pSetting->u32BaudRate, pSetting->u8Config);
+  delay(ku8MBLinkSettleTime);
+  while (MBSerial.available())
+  {
+    MBSerial.read();
+  }
+  
+  // 8-byte request + 7-byte response, plus slave turnaround
+  setTimeout(frameTime(15) / 1000 + 1 + ku8MBScanTurnaround);
+}
+
+
+/**
+Probe the slaves on a bus at the current setting.
+
+@param pu8Slaves slave IDs
+@param ppProfiles profile per slave (0 = none)
+@param u8SlaveCount number of slaves
+@param u8Probes probes per slave
+@param pQuality destination for the measured link quality
+@return number of failed probes (saturates at 255)
+*/
+uint8_t ModbusMaster::probeLink(const uint8_t *pu8Slaves,
+  const ModbusBaudProfile * const *ppProfiles, uint8_t u8SlaveCount,
+  uint8_t u8Probes, ModbusLinkQuality *pQuality)
+{
+  uint32_t u32Start = micros(), u32Elapsed;
+  uint8_t i, j;
+  
+  pQuality->u16Probes = 0;
+  pQuality->u16Errors = 0;
+  for (j = 0; j < u8Probes; j++)
+  {
+    for (i = 0; i < u8SlaveCount; i++)
+    {
+      _u8MBSlave = pu8Slaves[i];
+      pQuality->u16Probes++;
+      if (readHoldingRegisters((ppProfiles && ppProfiles[i]) ? 
+        ppProfiles[i]->u16BaudRegister : 0, 1) >= ku8MBInvalidSlaveID)
+      {
+        pQuality->u16Errors++;
+      }
+    }
+  }
+  
+  // in units of 100 us so the byte count * 10000 cannot overflow
+  u32Elapsed = max((micros() - u32Start) / 100, 1UL);
+  pQuality->u32Throughput = (pQuality->u16Probes - pQuality->u16Errors) * 15UL * 
+    10000UL / u32Elapsed;
+  return min(pQuality->u16Errors, 0xFF);
+}
+
+
+/**
+Check whether every slave on a bus can be switched between two settings.
+
+@param ppProfiles profile per slave (0 = none)
+@param u8SlaveCount number of slaves
+@param pSettings candidate settings
+@param u8From index of the current setting
+@param u8To index of the setting to switch to
+@return 1 if all slaves have a profile supporting both u8From and u8To, 
+so they can be switched there and back; 0 otherwise
+*/
+uint8_t ModbusMaster::canSwitchLink(const ModbusBaudProfile * const *ppProfiles,
+  uint8_t u8SlaveCount, const ModbusLinkSetting *pSettings, uint8_t u8From, uint8_t u8To)
+{
+  const ModbusBaudProfile *pProfile;
+  uint8_t i;
+  
+  for (i = 0; i < u8SlaveCount; i++)
+  {
+    pProfile = ppProfiles ? ppProfiles[i] : 0;
+    if (!pProfile || pProfile->pu16BaudCodes[u8From] == 0xFFFF ||
+      pProfile->pu16BaudCodes[u8To] == 0xFFFF)
+    {
+      return 0;
+    }
+    if (pProfile->u16FormatRegister == 0xFFFF ? 
+      pSettings[u8To].u8Config != pSettings[u8From].u8Config :
+      (pProfile->pu16FormatCodes[u8From] == 0xFFFF || 
+      pProfile->pu16FormatCodes[u8To] == 0xFFFF))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/**
+Switch the slaves on a bus, then the serial port, to another setting.
+
+The profile register writes are sent at the current setting; their 
+results are ignored since a slave may change over before it answers.
+
+@param pu8Slaves slave IDs
+@param ppProfiles profile per slave
+@param u8SlaveCount number of slaves
+@param pSettings candidate settings
+@param u8To index of the setting to switch to
+*/
+void ModbusMaster::switchLink(const uint8_t *pu8Slaves,
+  const ModbusBaudProfile * const *ppProfiles, uint8_t u8SlaveCount,
+  const ModbusLinkSetting *pSettings, uint8_t u8To)
+{
+  const ModbusBaudProfile *pProfile;
+  uint8_t i;
+  
+  for (i = 0; i < u8SlaveCount; i++)
+  {
+    pProfile = ppProfiles[i];
+    _u8MBSlave = pu8Slaves[i];
+    writeSingleRegister(pProfile->u16BaudRegister, pProfile->pu16BaudCodes[u8To]);
+    if (pProfile->u16FormatRegister != 0xFFFF)
+    {
+      writeSingleRegister(pProfile->u16FormatRegister, pProfile->pu16FormatCodes[u8To]);
+    }
+    if (pProfile->u16ApplyRegister != 0xFFFF)
+    {
+      writeSingleRegister(pProfile->u16ApplyRegister, pProfile->u16ApplyValue);
+    }
+  }
+  setLink(&pSettings[u8To]);
+}
+#endif
+
+
+/**
+Idle until the next interrupt.
+
+Enters idle sleep unless a response character or the TX-complete event 
+is already pending. Interrupts are disabled across the check, and sei() 
+guarantees the following sleep instruction executes before any pending 
+interrupt is serviced, so a wake-up cannot be lost between the check and 
+going to sleep.
+*/
+void ModbusMaster::idle()
+{
+  uint32_t u32Start = micros();
+  
+  cli();
+  if (!MBSerial.available() && !MBTXComplete)
+  {
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+  }
+  sei();
+  _u32SleepTime += micros() - u32Start;
+}
+
+
+/**
+Set a response timeout computed by the library.
+
+@param u32Timeout response timeout [milliseconds]; capped at the maximum 
+of __MODBUSMASTER_TIMEOUT_TYPE__
+*/
+void ModbusMaster::setTimeout(uint32_t u32Timeout)
+{
+  _tMBResponseTimeout = (u32Timeout < (MBTimeout) ~(MBTimeout) 0) ? 
+    (MBTimeout) u32Timeout : (MBTimeout) ~(MBTimeout) 0;
+}
+
+
+/**
+Prepare the line for a request.
+
+Enables the RS-485 driver (and disables the receiver) and applies the 
+pre-transmission delay. On serial port 1, also clears a stale 
+TX-complete flag so the TX-complete interrupt only fires for this 
+request.
+*/
+void ModbusMaster::beginTransmission()
+{
+  if (_pfnPreTransmission) _pfnPreTransmission();
+  if (_u8RTSMask) *_u8RTSPort |= _u8RTSMask; //Enable RTS Line if defined
+  if (_u8REMask) *_u8REPort |= _u8REMask;
+  if (_u16PreDelay) delayMicroseconds(_u16PreDelay);
+  
+#if defined(USART1_TX_vect)
+  if (_u8SerialPort == 1)
+  {
+    // hand the pins to the TX-complete interrupt unless a post delay is needed
+    MBDEPort = _u8RTSPort;
+    MBDEMask = _u16PostDelay ? 0 : _u8RTSMask;
+    MBREPort = _u8REPort;
+    MBREMask = _u16PostDelay ? 0 : _u8REMask;
+    MBTXComplete = 0;
+    UCSR1A |= 1 << TXC1;
+  }
+#endif
+}
+
+
+/**
+Wait for the request to leave the shift register and turn the line 
+around.
+
+On serial port 1, the TX-complete interrupt signals the end of the last 
+stop bit (and has already released the driver unless a 
+post-transmission delay is set); the MCU busy-waits or idles meanwhile, 
+as configured. Other ports wait in the core's flush(), which returns 
+after the last stop bit, without idle sleep.
+*/
+void ModbusMaster::endTransmission()
+{
+#if defined(USART1_TX_vect)
+  uint8_t u8SREG;
+  
+  if (_u8SerialPort == 1)
+  {
+    // the core's UDRE interrupt also modifies UCSR1B
+    u8SREG = SREG;
+    cli();
+    UCSR1B |= 1 << TXCIE1;
+    SREG = u8SREG;
+    while (!MBTXComplete)
+    {
+      if (_u8IdleSleep) idle();
+    }
+    MBTXComplete = 0;
+  }
+  else
+#endif
+  {
+    MBSerial.flush();
+  }
+  
+  // the interrupt may have released the pins already
+  if (_u16PostDelay) delayMicroseconds(_u16PostDelay);
+  if (_u8RTSMask) *_u8RTSPort &= ~_u8RTSMask; //Disable RTS Line if defined
+  if (_u8REMask) *_u8REPort &= ~_u8REMask;
+  if (_pfnPostTransmission) _pfnPostTransmission();
+}
+
+
+#if __MODBUSMASTER_CAPTURE__
+/**
+Append a frame to the capture ring.
+
+Overwrites the oldest records as needed; frames larger than the whole 
+ring are dropped.
+
+@param u8Direction ku8MBCaptureTX or ku8MBCaptureRX
+@param u8Status transaction status (0 for requests)
+@param u32Time time the frame started [micros()]
+@param pu8ADU frame bytes
+@param u8Size frame length [bytes]
+*/
+void ModbusMaster::capture(uint8_t u8Direction, uint8_t u8Status,
+  uint32_t u32Time, uint8_t *pu8ADU, uint8_t u8Size)
+{
+  uint16_t i, u16Head;
+  uint16_t u16Needed = 7 + u8Size;
+  uint8_t u8Record[7] = 
+  {
+    (uint8_t)u32Time, (uint8_t)(u32Time >> 8), (uint8_t)(u32Time >> 16), 
+    (uint8_t)(u32Time >> 24), u8Direction, u8Status, u8Size
+  };
+  
+  if (u16Needed > _u16CaptureSize)
+  {
+    _u32CaptureDropped++;
+    return;
+  }
+  
+  // drop oldest records until the new one fits
+  while (_u16CaptureSize - _u16CaptureUsed < u16Needed)
+  {
+    i = 7 + captureByte(6);
+    _u16CaptureTail = (_u16CaptureTail + i) % _u16CaptureSize;
+    _u16CaptureUsed -= i;
+    _u32CaptureDropped++;
+  }
+  
+  u16Head = (_u16CaptureTail + _u16CaptureUsed) % _u16CaptureSize;
+  for (i = 0; i < u16Needed; i++)
+  {
+    _pu8Capture[u16Head] = (i < 7) ? u8Record[i] : pu8ADU[i - 7];
+    if (++u16Head == _u16CaptureSize)
+    {
+      u16Head = 0;
+    }
+  }
+  _u16CaptureUsed += u16Needed;
+}
+
+
+/**
+Read a byte of the oldest capture record.
+
+@param u16Offset offset from the start of the oldest record
+@return byte at that offset in the ring
+*/
+uint8_t ModbusMaster::captureByte(uint16_t u16Offset)
+{
+  return _pu8Capture[(_u16CaptureTail + u16Offset) % _u16CaptureSize];
+}
+#endif
+
+
+#if __MODBUSMASTER_HEALTH__
+/**
+Record the result of a transaction in the slave health table and, if it 
+failed, in the error log.
+
+@param u8MBFunction function requested
+@param u8MBStatus transaction result
+@param pu8ADU response bytes received
+@param u8Size number of response bytes received
+*/
+void ModbusMaster::record(uint8_t u8MBFunction, uint8_t u8MBStatus,
+  const uint8_t *pu8ADU, uint8_t u8Size)
+{
+  ModbusSlaveHealth *pHealth = health(_u8MBSlave);
+  ModbusErrorEvent *pEvent;
+  uint8_t i;
+  
+  if (pHealth)
+  {
+    pHealth->u16ErrorRate -= pHealth->u16ErrorRate >> ku8MBErrorRateShift;
+    if (u8MBStatus >= ku8MBInvalidSlaveID)
+    {
+      pHealth->u16ErrorRate += 0xFFFF >> ku8MBErrorRateShift;
+      if (pHealth->u16Errors < 0xFFFF)
+      {
+        pHealth->u16Errors++;
+      }
+    }
+    
+    // hysteresis keeps a slave near the threshold from flapping
+    pHealth->u8Degraded = _u16DegradeThreshold && 
+      (pHealth->u16ErrorRate > _u16DegradeThreshold || 
+      (pHealth->u8Degraded && pHealth->u16ErrorRate >= (_u16DegradeThreshold >> 1)));
+  }
+  
+  if (u8MBStatus && _pErrorLog)
+  {
+    pEvent = &_pErrorLog[_u8ErrorLogHead];
+    pEvent->u32Time = millis();
+    pEvent->u8MBSlave = _u8MBSlave;
+    pEvent->u8MBFunction = u8MBFunction;
+    pEvent->u8Status = u8MBStatus;
+    pEvent->u8Size = u8Size;
+    for (i = 0; i < sizeof(pEvent->u8Header); i++)
+    {
+      pEvent->u8Header[i] = (i < u8Size) ? pu8ADU[i] : 0;
+    }
+    
+    _u8ErrorLogHead = (_u8ErrorLogHead + 1) % _u8ErrorLogSize;
+    if (_u8ErrorLogCount < _u8ErrorLogSize)
+    {
+      _u8ErrorLogCount++;
+    }
+  }
+}
+
+
+/**
+Look up a slave in the health table.
+
+@param u8MBSlave slave ID
+@return health table entry; 0 if the slave is not in the table
+*/
+ModbusSlaveHealth *ModbusMaster::health(uint8_t u8MBSlave)
+{
+  uint8_t u8Entry = u8MBSlave - _u8HealthFirst;
+  
+  return (_pHealth && u8MBSlave >= _u8HealthFirst && u8Entry < _u8HealthCount) ? 
+    &_pHealth[u8Entry] : 0;
+}
+#endif
+
+
+/**
+Size of the request ADU for a request descriptor.
+
+@param pRequest request to size
+@return request frame size, including slave ID and CRC [bytes]
+*/
+uint16_t ModbusMaster::requestSize(ModbusRequest *pRequest)
+{
+  return requestSize(pRequest->u8MBFunction, pRequest->u16WriteQty);
+}
+
+
+/**
+Size of the request ADU for a function and write quantity.
+
+@param u8MBFunction Modbus function
+@param u16WriteQty quantity of registers/coils to write
+@return request frame size, including slave ID and CRC [bytes]
+*/
+uint16_t ModbusMaster::requestSize(uint8_t u8MBFunction, uint16_t u16WriteQty)
+{
+  switch(u8MBFunction)
+  {
+    case ku8MBWriteMultipleCoils:
+      return 9 + ((u16WriteQty + 7) >> 3);
+      
+    case ku8MBWriteMultipleRegisters:
+      return 9 + 2 * u16WriteQty;
+      
+    case ku8MBMaskWriteRegister:
+      return 10;
+      
+    case ku8MBReadWriteMultipleRegisters:
+      return 13 + 2 * u16WriteQty;
+      
+    case ku8MBReadFifoQueue:
+      return 6;
+      
+    case ku8MBEncapsulatedInterface:
+      return 7;
+      
+    case ku8MBReadFileRecord:
+      return 12;
+      
+    case ku8MBWriteFileRecord:
+      return 12 + 2 * u16WriteQty;
+      
+    default:
+      return 8;
+  }
+}
+
+
+/**
+Size of the expected response ADU for a request descriptor.
+
+Worst case is assumed where the response length is chosen by the slave.
+
+@param pRequest request to size
+@return response frame size, including slave ID and CRC [bytes]
+*/
+uint16_t ModbusMaster::responseSize(ModbusRequest *pRequest)
+{
+  switch(pRequest->u8MBFunction)
+  {
+    case ku8MBReadCoils:
+    case ku8MBReadDiscreteInputs:
+      return 5 + ((pRequest->u16ReadQty + 7) >> 3);
+      
+    case ku8MBReadHoldingRegisters:
+    case ku8MBReadInputRegisters:
+    case ku8MBReadWriteMultipleRegisters:
+      return 5 + 2 * pRequest->u16ReadQty;
+      
+    case ku8MBMaskWriteRegister:
+      return 10;
+      
+    case ku8MBReadFifoQueue:
+      return 8 + 2 * 31;
+      
+    case ku8MBEncapsulatedInterface:
+      return 256;
+      
+    case ku8MBReadFileRecord:
+      return 7 + 2 * pRequest->u16ReadQty;
+      
+    case ku8MBWriteFileRecord:
+      return 12 + 2 * pRequest->u16WriteQty;
+      
+    default:
+      return 8;
+  }
+}
+
+
+/**
+Assemble a Modbus Request Application Data Unit.
+
+Builds the request for the given function from the current slave, 
+address/quantity members and transmit buffer (or bit set/record 
+source), and appends the CRC.
+
+@param u8ModbusADU destination frame buffer
+@param u8MBFunction Modbus function (0x01..0xFF)
+@return size of the frame, including CRC [bytes]
+*/
+uint8_t ModbusMaster::assembleADU(uint8_t u8ModbusADU[], uint8_t u8MBFunction)
+{
+  uint8_t u8ModbusADUSize = 0;
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__ || __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__ || \
+  __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__ || __MODBUSMASTER_FILE__
+  uint8_t i;
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__
+  uint8_t u8Qty;
+#endif
+  uint16_t u16CRC;
+  
+  u8ModbusADU[u8ModbusADUSize++] = _u8MBSlave;
+  u8ModbusADU[u8ModbusADUSize++] = u8MBFunction;
+  
+  switch(u8MBFunction)
+  {
+#if __MODBUSMASTER_READ_COILS__ || __MODBUSMASTER_READ_DISCRETE_INPUTS__ || __MODBUSMASTER_READ_INPUT_REGISTERS__ || __MODBUSMASTER_READ_HOLDING_REGISTERS__ || __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+#if __MODBUSMASTER_READ_COILS__
+    case ku8MBReadCoils:
+#endif
+#if __MODBUSMASTER_READ_DISCRETE_INPUTS__
+    case ku8MBReadDiscreteInputs:
+#endif
+#if __MODBUSMASTER_READ_INPUT_REGISTERS__
+    case ku8MBReadInputRegisters:
+#endif
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__
+    case ku8MBReadHoldingRegisters:
+#endif
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+    case ku8MBReadWriteMultipleRegisters:
+#endif
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
+      break;
+#endif
+#if __MODBUSMASTER_DIAGNOSTIC__
+      
+    case ku8MBEncapsulatedInterface:
+      u8ModbusADU[u8ModbusADUSize++] = ku8MBReadDeviceIdentification;
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
+      break;
+#endif
+#if __MODBUSMASTER_FILE__
+      
+    case ku8MBReadFifoQueue:
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      break;
+      
+    case ku8MBReadFileRecord:
+      u8ModbusADU[u8ModbusADUSize++] = 7;
+      u8ModbusADU[u8ModbusADUSize++] = ku8MBFileReferenceType;
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadAddress);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16ReadQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16ReadQty);
+      break;
+#endif
+  }
+  
+  switch(u8MBFunction)
+  {
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__ || __MODBUSMASTER_MASK_WRITE_REGISTER__ || __MODBUSMASTER_WRITE_MULTIPLE_COILS__ || \
+  __MODBUSMASTER_WRITE_SINGLE_REGISTER__ || __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__ || \
+  __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__ || __MODBUSMASTER_DIAGNOSTIC__
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__
+    case ku8MBWriteSingleCoil:
+#endif
+#if __MODBUSMASTER_MASK_WRITE_REGISTER__
+    case ku8MBMaskWriteRegister:
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__
+    case ku8MBWriteMultipleCoils:
+#endif
+#if __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+    case ku8MBWriteSingleRegister:
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
+    case ku8MBWriteMultipleRegisters:
+#endif
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+    case ku8MBReadWriteMultipleRegisters:
+#endif
+#if __MODBUSMASTER_DIAGNOSTIC__
+    case ku8MBDiagnostics:
+#endif
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteAddress);
+      break;
+#endif
+  }
+  
+  switch(u8MBFunction)
+  {
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__ || __MODBUSMASTER_DIAGNOSTIC__
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__
+    case ku8MBWriteSingleCoil:
+#endif
+#if __MODBUSMASTER_DIAGNOSTIC__
+    case ku8MBDiagnostics:
+#endif
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
+      break;
+#endif
+#if __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+      
+    case ku8MBWriteSingleRegister:
       u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TransmitBuffer[0]);
       u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TransmitBuffer[0]);
       break;
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__
       
     case ku8MBWriteMultipleCoils:
       u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
       u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
       u8Qty = (_u16WriteQty % 8) ? ((_u16WriteQty >> 3) + 1) : (_u16WriteQty >> 3);
       u8ModbusADU[u8ModbusADUSize++] = u8Qty;
+      if (_pu8BitData)
+      {
+        // bit set bytes are already in frame order
+        memcpy(&u8ModbusADU[u8ModbusADUSize], _pu8BitData, u8Qty);
+        u8ModbusADUSize += u8Qty;
+        break;
+      }
       for (i = 0; i < u8Qty; i++)
       {
         switch(i % 2)
@@ -586,9 +3304,15 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
         }
       }
       break;
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__ || __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
       
+#if __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
     case ku8MBWriteMultipleRegisters:
+#endif
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
     case ku8MBReadWriteMultipleRegisters:
+#endif
       u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
       u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
       u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty << 1);
@@ -599,6 +3323,8 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
         u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TransmitBuffer[i]);
       }
       break;
+#endif
+#if __MODBUSMASTER_MASK_WRITE_REGISTER__
       
     case ku8MBMaskWriteRegister:
       u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TransmitBuffer[0]);
@@ -606,46 +3332,157 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
       u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TransmitBuffer[1]);
       u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TransmitBuffer[1]);
       break;
+#endif
+#if __MODBUSMASTER_FILE__
+      
+    case ku8MBWriteFileRecord:
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(7 + (_u16WriteQty << 1));
+      u8ModbusADU[u8ModbusADUSize++] = ku8MBFileReferenceType;
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16FileNumber);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteAddress);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteAddress);
+      u8ModbusADU[u8ModbusADUSize++] = highByte(_u16WriteQty);
+      u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16WriteQty);
+      
+      if (_pfnRecordSource)
+      {
+        // let the caller fill the record data in place
+        _pfnRecordSource(_u16WriteAddress, &u8ModbusADU[u8ModbusADUSize], 
+          lowByte(_u16WriteQty));
+        u8ModbusADUSize += lowByte(_u16WriteQty << 1);
+      }
+      else
+      {
+        for (i = 0; i < lowByte(_u16WriteQty); i++)
+        {
+          u8ModbusADU[u8ModbusADUSize++] = highByte(_u16TransmitBuffer[i]);
+          u8ModbusADU[u8ModbusADUSize++] = lowByte(_u16TransmitBuffer[i]);
+        }
+      }
+      break;
+#endif
   }
   
   
   // append CRC
-  u16CRC = 0xFFFF;
-  for (i = 0; i < u8ModbusADUSize; i++)
-  {
-    u16CRC = _crc16_update(u16CRC, u8ModbusADU[i]);
-  }
+  u16CRC = calculateCRC(u8ModbusADU, u8ModbusADUSize);
   u8ModbusADU[u8ModbusADUSize++] = lowByte(u16CRC);
   u8ModbusADU[u8ModbusADUSize++] = highByte(u16CRC);
-  u8ModbusADU[u8ModbusADUSize] = 0;
   
-  // transmit request
-  if (_u8RTSMask) *_u8RTSPort |= _u8RTSMask; //Enable RTS Line if defined
+  return u8ModbusADUSize;
+}
+
+
+/**
+Modbus transaction engine.
+Sequence:
+  - assemble Modbus Request Application Data Unit (ADU),
+    based on particular function called
+  - transmit request over selected serial port
+  - wait for/retrieve response
+  - evaluate/disassemble response
+  - return status (success/exception)
+
+@param u8MBFunction Modbus function (0x01..0xFF)
+@return 0 on success; exception number on failure
+*/
+uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
+{
+  uint8_t u8ModbusADU[ku16MaxADUSize];
+  uint8_t u8ModbusADUSize = 0;
+  uint8_t i;
+#if __MODBUSMASTER_FILE__
+  uint8_t u8Qty;
+#endif
+  uint16_t u16CRC;
+  uint32_t u32RXStartTime, u32FrameTime = 0;
+  uint8_t u8BytesLeft = 8;
+  uint8_t u8MBStatus = ku8MBSuccess;
+#if __MODBUSMASTER_DIAGNOSTIC__
+  uint8_t u8ObjectOffset = 0, u8ObjectsLeft = 0;
+#endif
+  
+  // the request must fit the frame buffer, and data taken from the 
+  // transmit buffer must lie within it
+  if (requestSize(u8MBFunction, _u16WriteQty) > ku16MaxADUSize ||
+    (!_pu8BitData && writeWords(u8MBFunction, _u16WriteQty) > ku8MaxBufferSize))
+  {
+    return ku8MBIllegalDataValue;
+  }
+  
+  // assemble Modbus Request Application Data Unit, unless it was prepared
+  // while the previous response was arriving
+  if (_u8PreparedSize && _pPrepared == _pActive)
+  {
+    memcpy(u8ModbusADU, _u8PreparedADU, _u8PreparedSize);
+    u8ModbusADUSize = _u8PreparedSize;
+  }
+  else
+  {
+    u8ModbusADUSize = assembleADU(u8ModbusADU, u8MBFunction);
+  }
+  _u8PreparedSize = 0;
+  
+  // keep the line silent for t3.5 after the previous frame
+  u32FrameTime = interFrameDelay();
+  while (micros() - _u32LastFrameEnd < u32FrameTime)
+  {
+    if (_u8IdleSleep)
+    {
+      idle();
+    }
+  }
   
+  // transmit request
+  _u32FrameStart = micros();
+  _u8FrameSize = u8ModbusADUSize;
+  beginTransmission();
   for (i = 0; i < u8ModbusADUSize; i++)
   {
     MBSerial.write(u8ModbusADU[i]);
   }
-  
+  endTransmission();
+#if __MODBUSMASTER_CAPTURE__
+  if (_pu8Capture)
+  {
+    // stamped with the time the frame actually went out
+    capture(ku8MBCaptureTX, ku8MBSuccess, _u32FrameStart, u8ModbusADU, u8ModbusADUSize);
+  }
+#endif
   u8ModbusADUSize = 0;
-  MBSerial.flush();
-
-  //Fix for Serial.Flush() not waiting for buffer to clear. Hardcoded to Serial1
-  while (!(UCSR1A & (1 << UDRE1)))  // Wait for empty transmit buffer
-	 UCSR1A |= 1 << TXC1;  // mark transmission not complete
-  while (!(UCSR1A & (1 << TXC1)));   // Wait for the transmission to complete
-		  
-  if (_u8RTSMask) *_u8RTSPort &= ~_u8RTSMask; //Disable RTS Line if defined
-	
+  
+  // encode the next queued request while the slave is busy
+  if (_u8PrepareAhead && _pActive)
+  {
+    prepareNext();
+  }
+  
   // loop until we run out of time or bytes, or an error occurs
   u32RXStartTime = millis();
-  while (millis() - u32RXStartTime < ku8MBResponseTimeout && u8BytesLeft && !u8MBStatus)
+  while (millis() - u32RXStartTime < _tMBResponseTimeout && u8BytesLeft && !u8MBStatus)
   {
     if (MBSerial.available())
     {
+#if __MODBUSMASTER_CAPTURE__
+      if (_pu8Capture && !u8ModbusADUSize)
+      {
+        u32FrameTime = micros();
+      }
+#endif
+      // reject responses larger than the frame buffer
+      if (u8ModbusADUSize + 1 > ku16MaxADUSize)
+      {
+        u8MBStatus = ku8MBInvalidCRC;
+        break;
+      }
       u8ModbusADU[u8ModbusADUSize++] = MBSerial.read();
       u8BytesLeft--;
     }
+    else if (_u8IdleSleep)
+    {
+      idle();
+    }
 	
     // evaluate slave ID, function code once enough bytes have been read
     if (u8ModbusADUSize == 5)
@@ -674,19 +3511,56 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
       // evaluate returned Modbus function code
       switch(u8ModbusADU[1])
       {
+#if __MODBUSMASTER_READ_COILS__
         case ku8MBReadCoils:
+#endif
+#if __MODBUSMASTER_READ_DISCRETE_INPUTS__
         case ku8MBReadDiscreteInputs:
+#endif
+#if __MODBUSMASTER_READ_INPUT_REGISTERS__
         case ku8MBReadInputRegisters:
+#endif
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__
         case ku8MBReadHoldingRegisters:
+#endif
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
         case ku8MBReadWriteMultipleRegisters:
+#endif
+        case ku8MBReadFileRecord:
+        case ku8MBWriteFileRecord:
           u8BytesLeft = u8ModbusADU[2];
           break;
           
+        case ku8MBReadFifoQueue:
+          u8BytesLeft = lowByte(word(u8ModbusADU[2], u8ModbusADU[3]) + 1);
+          break;
+          
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__
         case ku8MBWriteSingleCoil:
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__
         case ku8MBWriteMultipleCoils:
+#endif
+#if __MODBUSMASTER_WRITE_SINGLE_REGISTER__
         case ku8MBWriteSingleRegister:
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
+        case ku8MBWriteMultipleRegisters:
+#endif
+        case ku8MBDiagnostics:
+          u8BytesLeft = 3;
+          break;
+          
+#if __MODBUSMASTER_DIAGNOSTIC__
+        case ku8MBEncapsulatedInterface:
+          // verify response is for Read Device Identification
+          if (u8ModbusADU[2] != ku8MBReadDeviceIdentification)
+          {
+            u8MBStatus = ku8MBInvalidFunction;
+          }
           u8BytesLeft = 3;
           break;
+#endif
           
         case ku8MBMaskWriteRegister:
           u8BytesLeft = 5;
@@ -694,36 +3568,65 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
       }
     }
     
-    if (u8ModbusADUSize == 6)
+#if __MODBUSMASTER_DIAGNOSTIC__
+    // walk Read Device Identification object list as it arrives; each
+    // object header [ID, length] announces the bytes that follow it
+    if (u8ModbusADU[1] == ku8MBEncapsulatedInterface)
     {
-      switch(u8ModbusADU[1])
+      if (u8ModbusADUSize == 8)
       {
-        case ku8MBWriteMultipleRegisters:
-          u8BytesLeft = u8ModbusADU[5];
-          break;
+        u8ObjectsLeft = u8ModbusADU[7];
+        u8ObjectOffset = 8;
+        u8BytesLeft = 2;
+      }
+      else if (u8ObjectsLeft && u8ModbusADUSize == u8ObjectOffset + 2)
+      {
+        u8ObjectsLeft--;
+        u8BytesLeft = u8ModbusADU[u8ObjectOffset + 1] + 2;
+        u8ObjectOffset += u8BytesLeft;
       }
     }
+#endif
   }
   
+  _u32LastFrameEnd = micros();
+  _u8FrameSize = 0;
+  
   // verify response is large enough to inspect further
-  if (!u8MBStatus && (millis() - u32RXStartTime >= ku8MBResponseTimeout || u8ModbusADUSize < 5))
+  if (!u8MBStatus && (millis() - u32RXStartTime >= _tMBResponseTimeout || u8ModbusADUSize < 5))
   {
     u8MBStatus = ku8MBResponseTimedOut;
   }
   
-  // calculate CRC
-  u16CRC = 0xFFFF;
-  for (i = 0; i < (u8ModbusADUSize - 2); i++)
+  // calculate and verify CRC
+  if (!u8MBStatus)
+  {
+    u16CRC = calculateCRC(u8ModbusADU, u8ModbusADUSize - 2);
+    if (lowByte(u16CRC) != u8ModbusADU[u8ModbusADUSize - 2] ||
+      highByte(u16CRC) != u8ModbusADU[u8ModbusADUSize - 1])
+    {
+      u8MBStatus = ku8MBInvalidCRC;
+    }
+  }
+#if __MODBUSMASTER_FILE__
+  
+  // verify a file record response holds a single sub-response with the 
+  // records requested
+  if (!u8MBStatus && u8ModbusADU[1] == ku8MBReadFileRecord &&
+    (u8ModbusADU[2] != u8ModbusADU[3] + 1 || u8ModbusADU[3] != 2 * _u16ReadQty + 1 ||
+    u8ModbusADU[4] != ku8MBFileReferenceType))
   {
-    u16CRC = _crc16_update(u16CRC, u8ModbusADU[i]);
+    u8MBStatus = ku8MBInvalidResponse;
   }
+#endif
   
-  // verify CRC
-  if (!u8MBStatus && (lowByte(u16CRC) != u8ModbusADU[u8ModbusADUSize - 2] ||
-    highByte(u16CRC) != u8ModbusADU[u8ModbusADUSize - 1]))
+#if __MODBUSMASTER_CAPTURE__
+  if (_pu8Capture)
   {
-    u8MBStatus = ku8MBInvalidCRC;
+    capture(ku8MBCaptureRX, u8MBStatus, u8ModbusADUSize ? u32FrameTime : micros(), 
+      u8ModbusADU, u8ModbusADUSize);
   }
+#endif
 
   // disassemble ADU into words
   if (!u8MBStatus)
@@ -731,8 +3634,21 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
     // evaluate returned Modbus function code
     switch(u8ModbusADU[1])
     {
+#if __MODBUSMASTER_READ_COILS__ || __MODBUSMASTER_READ_DISCRETE_INPUTS__
+#if __MODBUSMASTER_READ_COILS__
       case ku8MBReadCoils:
+#endif
+#if __MODBUSMASTER_READ_DISCRETE_INPUTS__
       case ku8MBReadDiscreteInputs:
+#endif
+        if (_pu8BitData)
+        {
+          // bit set uses the frame byte order; copy what was requested
+          memcpy(_pu8BitData, &u8ModbusADU[3], 
+            min(u8ModbusADU[2], (_u16ReadQty + 7) >> 3));
+          break;
+        }
+        
         // load bytes into word; response bytes are ordered L, H, L, H, ...
         for (i = 0; i < (u8ModbusADU[2] >> 1); i++)
         {
@@ -751,10 +3667,18 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
           }
         }
         break;
+#endif
+#if __MODBUSMASTER_READ_INPUT_REGISTERS__ || __MODBUSMASTER_READ_HOLDING_REGISTERS__ || __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
         
+#if __MODBUSMASTER_READ_INPUT_REGISTERS__
       case ku8MBReadInputRegisters:
+#endif
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__
       case ku8MBReadHoldingRegisters:
+#endif
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
       case ku8MBReadWriteMultipleRegisters:
+#endif
         // load bytes into word; response bytes are ordered H, L, H, L, ...
         for (i = 0; i < (u8ModbusADU[2] >> 1); i++)
         {
@@ -764,7 +3688,66 @@ uint8_t ModbusMaster::ModbusMasterTransaction(uint8_t u8MBFunction)
           }
         }
         break;
+#endif
+#if __MODBUSMASTER_DIAGNOSTIC__
+        
+      case ku8MBDiagnostics:
+        _u16ResponseBuffer[0] = word(u8ModbusADU[4], u8ModbusADU[5]);
+        break;
+#endif
+#if __MODBUSMASTER_FILE__
+        
+      case ku8MBReadFileRecord:
+        // single sub-response: file response length, reference type, data
+        u8Qty = (u8ModbusADU[3] - 1) >> 1;
+        if (_pfnRecordSink)
+        {
+          _pfnRecordSink(_u16ReadAddress, &u8ModbusADU[5], u8Qty);
+        }
+        else
+        {
+          for (i = 0; i < u8Qty; i++)
+          {
+            if (i < ku8MaxBufferSize)
+            {
+              _u16ResponseBuffer[i] = word(u8ModbusADU[2 * i + 5], u8ModbusADU[2 * i + 6]);
+            }
+          }
+        }
+        break;
+        
+      case ku8MBReadFifoQueue:
+        // load FIFO count and queued registers; bytes are ordered H, L, ...
+        for (i = 0; i < (word(u8ModbusADU[2], u8ModbusADU[3]) >> 1); i++)
+        {
+          if (i < ku8MaxBufferSize)
+          {
+            _u16ResponseBuffer[i] = word(u8ModbusADU[2 * i + 4], u8ModbusADU[2 * i + 5]);
+          }
+        }
+        break;
+#endif
+#if __MODBUSMASTER_DIAGNOSTIC__
+        
+      case ku8MBEncapsulatedInterface:
+        // load header and object list into words; bytes are ordered H, L, ...
+        _u16ResponseBuffer[0] = word(u8ModbusADU[4], u8ModbusADU[5]);
+        _u16ResponseBuffer[1] = word(u8ModbusADU[6], u8ModbusADU[7]);
+        for (i = 0; 2 * i + 8 < u8ModbusADUSize - 2; i++)
+        {
+          if (i + 2 < ku8MaxBufferSize)
+          {
+            _u16ResponseBuffer[i + 2] = word(u8ModbusADU[2 * i + 8], 
+              (2 * i + 9 < u8ModbusADUSize - 2) ? u8ModbusADU[2 * i + 9] : 0);
+          }
+        }
+        break;
+#endif
     }
   }
+  
+#if __MODBUSMASTER_HEALTH__
+  record(u8MBFunction, u8MBStatus, u8ModbusADU, u8ModbusADUSize);
+#endif
   return u8MBStatus;
 }
@@ -6,6 +6,13 @@ Arduino library for communicating with Modbus slaves over RS232/485 (via RTU pro
 @defgroup buffer ModbusMaster Buffer Management
 @defgroup discrete Modbus Function Codes for Discrete Coils/Inputs
 @defgroup register Modbus Function Codes for Holding/Input Registers
+@defgroup diagnostic Modbus Function Codes for Diagnostics/Device Identification
+@defgroup file Modbus Function Codes for File Records/FIFO Queues
+@defgroup scan ModbusMaster Cyclic Scan
+@defgroup bitset ModbusMaster Coil/Discrete Input Bit Sets
+@defgroup capture ModbusMaster Bus Traffic Capture
+@defgroup queue ModbusMaster Shared Bus Request Queue
+@defgroup health ModbusMaster Error Log and Slave Health
 @defgroup constant Modbus Function Codes, Exception Codes
 */
 /*
@@ -48,6 +55,187 @@ Set to 1 to enable debugging features within class:
 //#define __MODBUSMASTER_DEBUG__ (1)
 
 
+/**
+@def __MODBUSMASTER_BUFFER_SIZE__ (64)
+Size of the response and transmit buffers [words] (1..123); each word 
+costs 4 bytes of RAM per ModbusMaster object. Larger values are reduced 
+to 123, the most registers a Write Multiple Registers request carries.
+*/
+#ifndef __MODBUSMASTER_BUFFER_SIZE__
+#define __MODBUSMASTER_BUFFER_SIZE__ (64)
+#endif
+#if __MODBUSMASTER_BUFFER_SIZE__ > 123
+#undef __MODBUSMASTER_BUFFER_SIZE__
+#define __MODBUSMASTER_BUFFER_SIZE__ (123)
+#endif
+
+
+/**
+@def __MODBUSMASTER_ADU_SIZE__ (256)
+Size of the frame buffer a transaction keeps on the stack [bytes] 
+(16..256). A request that does not fit is rejected with 
+ModbusMaster::ku8MBIllegalDataValue before anything is sent; a response 
+that does not fit fails with ModbusMaster::ku8MBInvalidCRC. 
+9 + 2 * __MODBUSMASTER_BUFFER_SIZE__ holds any register read or write 
+the buffers can take.
+*/
+#ifndef __MODBUSMASTER_ADU_SIZE__
+#define __MODBUSMASTER_ADU_SIZE__ (256)
+#endif
+
+
+/**
+@def __MODBUSMASTER_TIMEOUT_TYPE__ uint16_t
+Type of the response timeout. uint8_t saves RAM where timeouts stay 
+below 256 ms; uint32_t allows timeouts above 65535 ms. Timeouts the 
+library computes itself are capped at the type's maximum.
+*/
+#ifndef __MODBUSMASTER_TIMEOUT_TYPE__
+#define __MODBUSMASTER_TIMEOUT_TYPE__ uint16_t
+#endif
+
+
+/**
+@def __MODBUSMASTER_READ_COILS__ (1)
+Set to 0 to leave out function 0x01 Read Coils.
+*/
+#ifndef __MODBUSMASTER_READ_COILS__
+#define __MODBUSMASTER_READ_COILS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_READ_DISCRETE_INPUTS__ (1)
+Set to 0 to leave out function 0x02 Read Discrete Inputs.
+*/
+#ifndef __MODBUSMASTER_READ_DISCRETE_INPUTS__
+#define __MODBUSMASTER_READ_DISCRETE_INPUTS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_READ_HOLDING_REGISTERS__ (1)
+Set to 0 to leave out function 0x03 Read Holding Registers. 
+negotiateLink() needs it.
+*/
+#ifndef __MODBUSMASTER_READ_HOLDING_REGISTERS__
+#define __MODBUSMASTER_READ_HOLDING_REGISTERS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_READ_INPUT_REGISTERS__ (1)
+Set to 0 to leave out function 0x04 Read Input Registers.
+*/
+#ifndef __MODBUSMASTER_READ_INPUT_REGISTERS__
+#define __MODBUSMASTER_READ_INPUT_REGISTERS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_WRITE_SINGLE_COIL__ (1)
+Set to 0 to leave out function 0x05 Write Single Coil.
+*/
+#ifndef __MODBUSMASTER_WRITE_SINGLE_COIL__
+#define __MODBUSMASTER_WRITE_SINGLE_COIL__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_WRITE_SINGLE_REGISTER__ (1)
+Set to 0 to leave out function 0x06 Write Single Register. 
+negotiateLink() needs it.
+*/
+#ifndef __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+#define __MODBUSMASTER_WRITE_SINGLE_REGISTER__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_WRITE_MULTIPLE_COILS__ (1)
+Set to 0 to leave out function 0x0F Write Multiple Coils.
+*/
+#ifndef __MODBUSMASTER_WRITE_MULTIPLE_COILS__
+#define __MODBUSMASTER_WRITE_MULTIPLE_COILS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__ (1)
+Set to 0 to leave out function 0x10 Write Multiple Registers.
+*/
+#ifndef __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
+#define __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_MASK_WRITE_REGISTER__ (1)
+Set to 0 to leave out function 0x16 Mask Write Register.
+*/
+#ifndef __MODBUSMASTER_MASK_WRITE_REGISTER__
+#define __MODBUSMASTER_MASK_WRITE_REGISTER__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__ (1)
+Set to 0 to leave out function 0x17 Read Write Multiple Registers. 
+Queued requests are then never fused.
+*/
+#ifndef __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+#define __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_DIAGNOSTIC__ (1)
+Set to 0 to leave out functions 0x08 Diagnostics and 0x2B/0x0E Read 
+Device Identification, and discoverSlaves().
+*/
+#ifndef __MODBUSMASTER_DIAGNOSTIC__
+#define __MODBUSMASTER_DIAGNOSTIC__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_FILE__ (1)
+Set to 0 to leave out functions 0x14 Read File Record, 0x15 Write File 
+Record and 0x18 Read FIFO Queue, and file streaming.
+*/
+#ifndef __MODBUSMASTER_FILE__
+#define __MODBUSMASTER_FILE__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_SCAN__ (1)
+Set to 0 to leave out the cyclic scan (setScanTable(), scan()).
+*/
+#ifndef __MODBUSMASTER_SCAN__
+#define __MODBUSMASTER_SCAN__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_CAPTURE__ (1)
+Set to 0 to leave out bus traffic capture (setCapture()).
+*/
+#ifndef __MODBUSMASTER_CAPTURE__
+#define __MODBUSMASTER_CAPTURE__ (1)
+#endif
+
+
+/**
+@def __MODBUSMASTER_HEALTH__ (1)
+Set to 0 to leave out the error log and slave health tracking 
+(setErrorLog(), setHealthTable()).
+*/
+#ifndef __MODBUSMASTER_HEALTH__
+#define __MODBUSMASTER_HEALTH__ (1)
+#endif
+
+
 /* _____STANDARD INCLUDES____________________________________________________ */
 // include types & constants of Wiring core API
 #include <Arduino.h>
@@ -77,16 +265,216 @@ Macro to generate 32-bit integer from (2) 16-bit words.
 
 
 /* _____PROJECT INCLUDES_____________________________________________________ */
-// functions to calculate Modbus Application Data Unit CRC
-#include <util/crc16.h>
+// function codes, exception codes, CRC and bit sets shared with ModbusSlave
+#include "ModbusCodec.h"
+
+// functions to idle the MCU while waiting on the serial port
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+
+/* _____TYPE DEFINITIONS_____________________________________________________ */
+/**
+Response timeout [milliseconds], of the type set by 
+__MODBUSMASTER_TIMEOUT_TYPE__.
+
+@ingroup setup
+*/
+typedef __MODBUSMASTER_TIMEOUT_TYPE__ MBTimeout;
+
+
+/**
+Callback receiving file record data streamed by ModbusMaster::readFile().
+
+@param u16RecordNumber record number of the first register in pu8Data
+@param pu8Data register data as received, 2 bytes per register ordered H, L
+@param u8Qty quantity of registers in pu8Data
+@ingroup file
+*/
+typedef void (*MBRecordSink)(uint16_t u16RecordNumber, const uint8_t *pu8Data,
+  uint8_t u8Qty);
+
+
+/**
+Callback supplying file record data streamed by ModbusMaster::writeFile().
+
+@param u16RecordNumber record number of the first register to supply
+@param pu8Data destination in the request frame, 2 bytes per register ordered H, L
+@param u8Qty quantity of registers to place in pu8Data
+@ingroup file
+*/
+typedef void (*MBRecordSource)(uint16_t u16RecordNumber, uint8_t *pu8Data,
+  uint8_t u8Qty);
+
+
+class ModbusNode;
+struct ModbusRequest;
+
+
+/**
+Callback invoked by ModbusMaster::poll() once a queued request has been 
+executed; u8Status holds the result.
+
+@ingroup queue
+*/
+typedef void (*MBCompleteCallback)(ModbusRequest *pRequest);
+
+
+/**
+Modbus request descriptor.
+
+Describes one transaction independently of the blocking function calls, 
+so it can be stored in a table and executed by ModbusMaster::execute() 
+or the cyclic scan. Fields not used by the function are ignored.
+
+@ingroup scan
+*/
+struct ModbusRequest
+{
+  uint8_t  u8MBSlave;                ///< Modbus slave (1..255)
+  uint8_t  u8MBFunction;             ///< Modbus function (ModbusMaster::ku8MBReadCoils..)
+  uint16_t u16ReadAddress;           ///< slave register/coil from which to read
+  uint16_t u16ReadQty;               ///< quantity of registers/coils to read
+  uint16_t u16WriteAddress;          ///< slave register/coil to which to write
+  uint16_t u16WriteQty;              ///< quantity of registers/coils (or value, single writes) to write
+  uint16_t *pu16Data;                ///< words to write before the request; words read after it
+  uint8_t  u8Status;                 ///< result of the last execution
+  uint8_t  u8Priority;               ///< queue priority (ModbusMaster::ku8MBPriorityLow..ku8MBPriorityUrgent)
+  MBCompleteCallback pfnComplete;    ///< called when a queued request completes (0 = none)
+  uint32_t u32Submitted;             ///< submission time [micros()]; set by ModbusMaster::submit()
+  ModbusNode *pNode;                 ///< submitting node; set by ModbusNode::submit()
+  ModbusRequest *pNext;              ///< queue link; owned by ModbusMaster while queued
+};
+
+
+/**
+Cyclic scan timing statistics [microseconds].
+
+Start jitter is the delay between the scheduled and the actual start of 
+a cycle; duration is the time taken to execute the whole scan table.
+
+@ingroup scan
+*/
+struct ModbusScanStats
+{
+  uint32_t u32Cycles;                ///< cycles executed
+  uint32_t u32Overruns;              ///< cycles that exceeded the scan period
+  uint32_t u32PlannedDuration;       ///< duration computed from frame times when the table was set
+  uint32_t u32LastJitter;            ///< start jitter of the last cycle
+  uint32_t u32MaxJitter;             ///< largest start jitter seen
+  uint32_t u32LastDuration;          ///< duration of the last cycle
+  uint32_t u32MinDuration;           ///< shortest cycle duration seen
+  uint32_t u32MaxDuration;           ///< longest cycle duration seen
+};
+
+
+/**
+Queue latency statistics for one priority class.
+
+Latency runs from ModbusMaster::submit() to the completion of the 
+request. Class 0 of the histogram counts latencies below 1024 us, class 
+n (1..15) those from 2^(n + 9) to 2^(n + 10) - 1 us; class 15 also 
+counts anything longer. Counts saturate at 65535.
+
+@ingroup queue
+*/
+struct ModbusLatencyStats
+{
+  uint32_t u32Count;                 ///< requests completed
+  uint32_t u32Max;                   ///< longest latency seen [microseconds]
+  uint16_t u16Histogram[16];         ///< completions per latency class
+};
+
+
+/**
+Error log entry, recorded for every transaction that does not succeed.
+
+@ingroup health
+*/
+struct ModbusErrorEvent
+{
+  uint32_t u32Time;                  ///< end of the transaction [millis()]
+  uint8_t  u8MBSlave;                ///< slave addressed
+  uint8_t  u8MBFunction;             ///< function requested
+  uint8_t  u8Status;                 ///< result (exception, ModbusMaster::ku8MBInvalidSlaveID..ku8MBInvalidCRC or ku8MBInvalidResponse)
+  uint8_t  u8Size;                   ///< response bytes received
+  uint8_t  u8Header[3];              ///< first response bytes: slave, function, exception code/byte count (0 = not received)
+};
+
+
+/**
+Health of one slave.
+
+The error rate is a moving average over roughly the last 16 
+transactions of the communication errors (ModbusMaster::ku8MBInvalidSlaveID..
+ku8MBInvalidCRC, ku8MBInvalidResponse); an exception response proves the 
+link works and counts as a good transaction.
+
+@ingroup health
+*/
+struct ModbusSlaveHealth
+{
+  uint16_t u16ErrorRate;             ///< moving average error rate (0xFFFF = every transaction failed)
+  uint16_t u16Errors;                ///< communication errors seen (saturates at 65535)
+  uint8_t  u8Degraded;               ///< 1 while the error rate is above the degrade threshold
+};
+
+
+/**
+Serial link setting tried by ModbusMaster::negotiateLink().
+
+@ingroup setup
+*/
+struct ModbusLinkSetting
+{
+  uint32_t u32BaudRate;              ///< baud rate (300..115200)
+  uint8_t  u8Config;                 ///< frame format (SERIAL_8N1, SERIAL_8E1, ...)
+};
+
+
+/**
+Vendor profile describing how a slave's serial settings are changed.
+
+The code tables are indexed like the candidate settings passed to 
+ModbusMaster::negotiateLink(). New settings are written as single 
+registers (function 0x06) at the current setting: baud rate, frame 
+format, then the apply register, if any.
+
+@ingroup setup
+*/
+struct ModbusBaudProfile
+{
+  uint16_t u16BaudRegister;          ///< holding register selecting the baud rate; also read to probe the slave
+  const uint16_t *pu16BaudCodes;     ///< value selecting each candidate's baud rate (0xFFFF = not supported)
+  uint16_t u16FormatRegister;        ///< holding register selecting the frame format (0xFFFF = fixed format)
+  const uint16_t *pu16FormatCodes;   ///< value selecting each candidate's frame format (0xFFFF = not supported)
+  uint16_t u16ApplyRegister;         ///< holding register written to activate new settings (0xFFFF = none)
+  uint16_t u16ApplyValue;            ///< value written to u16ApplyRegister
+};
+
+
+/**
+Link quality measured by ModbusMaster::negotiateLink() at one setting.
+
+@ingroup setup
+*/
+struct ModbusLinkQuality
+{
+  uint16_t u16Probes;                ///< probe requests sent (0 = setting not tried)
+  uint16_t u16Errors;                ///< probes that failed (timeout, CRC, ...)
+  uint32_t u32Throughput;            ///< request and response bytes per second over all probes
+};
 
 
 /* _____CLASS DEFINITIONS____________________________________________________ */
 /**
 Arduino class library for communicating with Modbus slaves over 
 RS232/485 (via RTU protocol).
+
+Function codes, Modbus exception codes and the CRC are inherited from 
+ModbusCodec.
 */
-class ModbusMaster
+class ModbusMaster : public ModbusCodec
 {
   public:
     ModbusMaster();
@@ -97,172 +485,414 @@ class ModbusMaster
     void begin(uint32_t);
     void begin(uint32_t, uint8_t);
 	void setupRTS(uint8_t);
+    void setupRTS(uint8_t, uint8_t);
+    void setTransmitDelays(uint16_t, uint16_t);
+    void setDirectionCallbacks(MBDirectionCallback, MBDirectionCallback);
+    void setResponseTimeout(MBTimeout);
+    void setIdleSleep(uint8_t);
+    uint32_t getSleepTime();
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__ && __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+    uint8_t negotiateLink(const uint8_t *, const ModbusBaudProfile * const *, uint8_t,
+      const ModbusLinkSetting *, uint8_t, ModbusLinkQuality *);
+#endif
 	
-    // Modbus exception codes
+    // Class-defined exception codes
     /**
-    Modbus protocol illegal function exception.
+    ModbusMaster invalid response slave ID exception.
     
-    The function code received in the query is not an allowable action for
-    the server (or slave). This may be because the function code is only
-    applicable to newer devices, and was not implemented in the unit
-    selected. It could also indicate that the server (or slave) is in the
-    wrong state to process a request of this type, for example because it is
-    unconfigured and is being asked to return register values.
+    The slave ID in the response does not match that of the request.
     
     @ingroup constant
     */
-    static const uint8_t ku8MBIllegalFunction            = 0x01;
-
+    static const uint8_t ku8MBInvalidSlaveID             = 0xE0;
+    
     /**
-    Modbus protocol illegal data address exception.
-    
-    The data address received in the query is not an allowable address for 
-    the server (or slave). More specifically, the combination of reference 
-    number and transfer length is invalid. For a controller with 100 
-    registers, the ADU addresses the first register as 0, and the last one 
-    as 99. If a request is submitted with a starting register address of 96 
-    and a quantity of registers of 4, then this request will successfully 
-    operate (address-wise at least) on registers 96, 97, 98, 99. If a 
-    request is submitted with a starting register address of 96 and a 
-    quantity of registers of 5, then this request will fail with Exception 
-    Code 0x02 "Illegal Data Address" since it attempts to operate on 
-    registers 96, 97, 98, 99 and 100, and there is no register with address 
-    100. 
+    ModbusMaster invalid response function exception.
+    
+    The function code in the response does not match that of the request.
     
     @ingroup constant
     */
-    static const uint8_t ku8MBIllegalDataAddress         = 0x02;
+    static const uint8_t ku8MBInvalidFunction            = 0xE1;
     
     /**
-    Modbus protocol illegal data value exception.
+    ModbusMaster response timed out exception.
     
-    A value contained in the query data field is not an allowable value for 
-    server (or slave). This indicates a fault in the structure of the 
-    remainder of a complex request, such as that the implied length is 
-    incorrect. It specifically does NOT mean that a data item submitted for 
-    storage in a register has a value outside the expectation of the 
-    application program, since the MODBUS protocol is unaware of the 
-    significance of any particular value of any particular register.
+    The entire response was not received within the timeout period, 
+    ModbusMaster::ku8MBResponseTimeout unless changed via 
+    ModbusMaster::setResponseTimeout(). 
     
     @ingroup constant
     */
-    static const uint8_t ku8MBIllegalDataValue           = 0x03;
+    static const uint8_t ku8MBResponseTimedOut           = 0xE2;
     
     /**
-    Modbus protocol slave device failure exception.
+    ModbusMaster invalid response CRC exception.
     
-    An unrecoverable error occurred while the server (or slave) was
-    attempting to perform the requested action.
+    The CRC in the response does not match the one calculated.
     
     @ingroup constant
     */
-    static const uint8_t ku8MBSlaveDeviceFailure         = 0x04;
-
-    // Class-defined success/exception codes
+    static const uint8_t ku8MBInvalidCRC                 = 0xE3;
+    
     /**
-    ModbusMaster success.
-    
-    Modbus transaction was successful; the following checks were valid:
-      - slave ID
-      - function code
-      - response code
-      - data
-      - CRC
-      
+    ModbusMaster invalid response exception.
+    
+    The response passed the checks above but does not carry the data 
+    requested, e.g. a file record response with fewer records than were 
+    asked for.
+    
     @ingroup constant
     */
-    static const uint8_t ku8MBSuccess                    = 0x00;
+    static const uint8_t ku8MBInvalidResponse            = 0xE5;
     
     /**
-    ModbusMaster invalid response slave ID exception.
+    ModbusMaster request pending.
     
-    The slave ID in the response does not match that of the request.
+    Status of a request that has been submitted to the queue and not yet 
+    executed.
     
     @ingroup constant
     */
-    static const uint8_t ku8MBInvalidSlaveID             = 0xE0;
+    static const uint8_t ku8MBRequestPending             = 0xE4;
     
+    // Request queue priorities
     /**
-    ModbusMaster invalid response function exception.
+    Low queue priority, e.g. background polling.
     
-    The function code in the response does not match that of the request.
+    @ingroup queue
+    */
+    static const uint8_t ku8MBPriorityLow                = 0;
     
-    @ingroup constant
+    /**
+    Normal queue priority.
+    
+    @ingroup queue
     */
-    static const uint8_t ku8MBInvalidFunction            = 0xE1;
+    static const uint8_t ku8MBPriorityNormal             = 1;
     
     /**
-    ModbusMaster response timed out exception.
+    High queue priority, e.g. setpoint writes.
     
-    The entire response was not received within the timeout period, 
-    ModbusMaster::ku8MBResponseTimeout. 
+    @ingroup queue
+    */
+    static const uint8_t ku8MBPriorityHigh               = 2;
     
-    @ingroup constant
+    /**
+    Urgent queue priority, e.g. emergency stop writes.
+    
+    Urgent requests are not kept waiting for the queue to be polled: 
+    they are executed at the next request boundary, ahead of the queued 
+    request, cyclic scan entry or blocking function call that was about 
+    to start. Blocking calls that send the transmit buffer 
+    (writeMultipleCoils(uint16_t, uint16_t), writeMultipleRegisters(), 
+    readWriteMultipleRegisters(), writeFileRecord()) are not preceded by 
+    urgent requests, since those would overwrite the buffer; discovery, 
+    link negotiation and file streaming let them in between their own 
+    requests only, at the regular serial settings. The priority of a 
+    request must not change while it is queued.
+    
+    @ingroup queue
     */
-    static const uint8_t ku8MBResponseTimedOut           = 0xE2;
+    static const uint8_t ku8MBPriorityUrgent             = 3;
+
+    // Capture record directions
+    /**
+    Capture record of a request frame sent by ModbusMaster.
+    
+    @ingroup capture
+    */
+    static const uint8_t ku8MBCaptureTX                  = 0x00;
     
     /**
-    ModbusMaster invalid response CRC exception.
+    Capture record of a response frame (possibly partial or empty) 
+    received by ModbusMaster.
     
-    The CRC in the response does not match the one calculated.
+    @ingroup capture
+    */
+    static const uint8_t ku8MBCaptureRX                  = 0x01;
     
-    @ingroup constant
+    /**
+    pcap link type written by ModbusMaster::dumpCapture(): LINKTYPE_USER0. 
+    Each packet is one RTU ADU (slave ID through CRC); configure the 
+    Wireshark "DLT User" table to decode user 0 as mbrtu.
+    
+    @ingroup capture
     */
-    static const uint8_t ku8MBInvalidCRC                 = 0xE3;
+    static const uint8_t ku8MBCaptureLinkType            = 147;
+    
+    /**
+    Returned by ModbusMaster::negotiateLink() when the slaves answered at 
+    none of the candidate settings.
+    
+    @ingroup setup
+    */
+    static const uint8_t ku8MBLinkNotFound               = 0xFF;
     
     uint16_t getResponseBuffer(uint8_t);
     void     clearResponseBuffer();
     uint8_t  setTransmitBuffer(uint8_t, uint16_t);
     void     clearTransmitBuffer();
     
+#if __MODBUSMASTER_READ_COILS__
     uint8_t  readCoils(uint16_t, uint16_t);
+    uint8_t  readCoils(uint16_t, ModbusBitSet &);
+#endif
+#if __MODBUSMASTER_READ_DISCRETE_INPUTS__
     uint8_t  readDiscreteInputs(uint16_t, uint16_t);
+    uint8_t  readDiscreteInputs(uint16_t, ModbusBitSet &);
+#endif
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__
     uint8_t  readHoldingRegisters(uint16_t, uint16_t);
+#endif
+#if __MODBUSMASTER_READ_INPUT_REGISTERS__
     uint8_t  readInputRegisters(uint16_t, uint8_t);
+#endif
+#if __MODBUSMASTER_WRITE_SINGLE_COIL__
     uint8_t  writeSingleCoil(uint16_t, uint8_t);
+#endif
+#if __MODBUSMASTER_WRITE_SINGLE_REGISTER__
     uint8_t  writeSingleRegister(uint16_t, uint16_t);
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_COILS__
     uint8_t  writeMultipleCoils(uint16_t, uint16_t);
+    uint8_t  writeMultipleCoils(uint16_t, ModbusBitSet &);
+#endif
+#if __MODBUSMASTER_WRITE_MULTIPLE_REGISTERS__
     uint8_t  writeMultipleRegisters(uint16_t, uint16_t);
+#endif
+#if __MODBUSMASTER_MASK_WRITE_REGISTER__
     uint8_t  maskWriteRegister(uint16_t, uint16_t, uint16_t);
+#endif
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
     uint8_t  readWriteMultipleRegisters(uint16_t, uint16_t, uint16_t, uint16_t);
+#endif
+    
+#if __MODBUSMASTER_DIAGNOSTIC__
+    uint8_t  diagnostics(uint16_t, uint16_t);
+    uint8_t  readDeviceIdentification(uint8_t, uint8_t);
+    uint8_t  discoverSlaves(uint8_t, uint8_t, uint8_t *);
+#endif
+    
+#if __MODBUSMASTER_FILE__
+    uint8_t  readFileRecord(uint16_t, uint16_t, uint16_t);
+    uint8_t  writeFileRecord(uint16_t, uint16_t, uint16_t);
+    uint8_t  readFile(uint16_t, uint16_t, uint16_t, MBRecordSink);
+    uint8_t  writeFile(uint16_t, uint16_t, uint16_t, MBRecordSource);
+    uint8_t  readFifoQueue(uint16_t);
+#endif
+    
+    uint8_t  execute(ModbusRequest *);
+    uint32_t frameTime(uint16_t);
+    uint32_t interFrameDelay();
+    uint32_t transactionTime(ModbusRequest *);
+#if __MODBUSMASTER_SCAN__
+    uint8_t  setScanTable(ModbusRequest *, uint8_t, uint32_t);
+    uint8_t  scan();
+    void     getScanStats(ModbusScanStats *);
+    void     clearScanStats();
+#endif
+    
+#if __MODBUSMASTER_CAPTURE__
+    void     setCapture(uint8_t *, uint16_t);
+    void     clearCapture();
+    uint32_t getCaptureDropped();
+    void     dumpCapture(Print &);
+#endif
+    
+#if __MODBUSMASTER_HEALTH__
+    void     setErrorLog(ModbusErrorEvent *, uint8_t);
+    uint8_t  getErrorCount();
+    uint8_t  getErrorEvent(uint8_t, ModbusErrorEvent *);
+    void     clearErrorLog();
+    void     setHealthTable(ModbusSlaveHealth *, uint8_t, uint8_t);
+    void     setDegradeThreshold(uint16_t);
+    uint16_t getErrorRate(uint8_t);
+    uint8_t  isDegraded(uint8_t);
+#endif
+    
+    uint8_t  submit(ModbusRequest *);
+    uint8_t  poll();
+    uint8_t  pending();
+    void     invalidate(ModbusRequest *);
+    uint32_t urgentLatencyBound();
+    void     getLatencyStats(uint8_t, ModbusLatencyStats *);
+    uint32_t getLatencyPercentile(uint8_t, uint8_t);
+    void     clearLatencyStats();
+    void     setPrepareAhead(uint8_t);
     
   private:
     uint8_t  _u8SerialPort;                                      ///< serial port (0..3) initialized in constructor
     uint8_t  _u8MBSlave;                                         ///< Modbus slave (1..255) initialized in constructor
-    uint16_t _u16BaudRate;                                       ///< baud rate (300..115200) initialized in begin()
-    static const uint8_t ku8MaxBufferSize                = 64;   ///< size of response/transmit buffers    
+    uint32_t _u32BaudRate;                                       ///< baud rate (300..115200) initialized in begin()
+    uint8_t  _u8SerialConfig;                                    ///< frame format initialized in begin()
+    MBTimeout _tMBResponseTimeout;                               ///< response timeout [milliseconds]; set via setResponseTimeout()
+    static const uint8_t ku8MaxBufferSize                = __MODBUSMASTER_BUFFER_SIZE__; ///< size of response/transmit buffers
+    static const uint16_t ku16MaxADUSize                 = __MODBUSMASTER_ADU_SIZE__;    ///< size of transaction frame buffer
+    static const uint8_t ku8MBPreparedADUSize            = 16;   ///< size of staging buffer for the next request frame
     uint16_t _u16ReadAddress;                                    ///< slave register from which to read
     uint16_t _u16ReadQty;                                        ///< quantity of words to read
     uint16_t _u16ResponseBuffer[ku8MaxBufferSize];               ///< buffer to store Modbus slave response; read via GetResponseBuffer()
     uint16_t _u16WriteAddress;                                   ///< slave register to which to write
     uint16_t _u16WriteQty;                                       ///< quantity of words to write
     uint16_t _u16TransmitBuffer[ku8MaxBufferSize];               ///< buffer containing data to transmit to Modbus slave; set via SetTransmitBuffer()
+#if __MODBUSMASTER_FILE__
+    uint16_t _u16FileNumber;                                     ///< file number for file record access
+    MBRecordSink _pfnRecordSink;                                 ///< streaming destination for file record reads (0 = response buffer)
+    MBRecordSource _pfnRecordSource;                             ///< streaming source for file record writes (0 = transmit buffer)
+#endif
+    uint8_t  *_pu8BitData;                                       ///< bit set storage for coil reads/writes (0 = response/transmit buffer)
+#if __MODBUSMASTER_SCAN__
+    ModbusRequest *_pScanTable;                                  ///< requests executed by scan(), in order
+    uint8_t  _u8ScanCount;                                       ///< number of requests in scan table
+    uint32_t _u32ScanPeriod;                                     ///< scan period [microseconds]
+    uint32_t _u32ScanNext;                                       ///< scheduled start of next cycle [micros()]
+    ModbusScanStats _ScanStats;                                  ///< cyclic scan timing statistics
+#endif
+#if __MODBUSMASTER_CAPTURE__
+    uint8_t  *_pu8Capture;                                       ///< capture ring storage (0 = capture disabled)
+    uint16_t _u16CaptureSize;                                    ///< size of capture ring [bytes]
+    uint16_t _u16CaptureTail;                                    ///< offset of oldest capture record
+    uint16_t _u16CaptureUsed;                                    ///< bytes in use in capture ring
+    uint32_t _u32CaptureDropped;                                 ///< records overwritten before being dumped
+#endif
+#if __MODBUSMASTER_HEALTH__
+    ModbusErrorEvent *_pErrorLog;                                ///< error log ring storage (0 = logging disabled)
+    uint8_t  _u8ErrorLogSize;                                    ///< size of error log ring [events]
+    uint8_t  _u8ErrorLogHead;                                    ///< index of the next event to write
+    uint8_t  _u8ErrorLogCount;                                   ///< events in error log ring
+    ModbusSlaveHealth *_pHealth;                                 ///< slave health table (0 = not tracked)
+    uint8_t  _u8HealthFirst;                                     ///< slave ID of the first health table entry
+    uint8_t  _u8HealthCount;                                     ///< number of health table entries
+    uint16_t _u16DegradeThreshold;                               ///< error rate that degrades a slave (0 = never)
+#endif
+    ModbusRequest *_pQueue;                                      ///< queued requests, in submission order
+    uint16_t _u16ServiceSeq;                                     ///< incremented each time a node is served
+    ModbusRequest *_pActive;                                     ///< request being executed (0 = direct function call)
+    ModbusRequest *_pPrepared;                                   ///< request encoded in staging buffer
+    uint8_t  _u8PreparedADU[ku8MBPreparedADUSize];               ///< staging buffer for the next request frame
+    uint8_t  _u8PreparedSize;                                    ///< size of staged frame (0 = none)
+    uint8_t  _u8PrepareAhead;                                    ///< encode next queued request during the response wait
+    uint32_t _u32LastFrameEnd;                                   ///< end of the last response or timeout [micros()]
+    volatile uint8_t _u8UrgentPending;                           ///< urgent requests queued
+    uint8_t  _u8UrgentHold;                                      ///< urgent requests held back while non-zero (composite call in progress)
+    uint32_t _u32FrameStart;                                     ///< start of the transaction in progress [micros()]
+    uint8_t  _u8FrameSize;                                       ///< request size of the transaction in progress (0 = none)
+    ModbusLatencyStats _LatencyStats[ku8MBPriorityUrgent + 1];   ///< queue latency statistics per priority
+    uint8_t  _u8IdleSleep;                                       ///< idle sleep while waiting on the serial port (0 = busy wait)
+    uint32_t _u32SleepTime;                                      ///< time spent in idle sleep [microseconds]
 	volatile uint8_t* _u8RTSPort;								 ///< RTS Pin Port
 	uint8_t _u8RTSMask; 										 ///< RTS Pin Mask (Default: 0 Undefined/Unused)
+    volatile uint8_t* _u8REPort;                                 ///< /RE (receiver enable, active low) pin port
+    uint8_t  _u8REMask;                                          ///< /RE pin mask (0 = unused)
+    uint16_t _u16PreDelay;                                       ///< delay from driver enable to first start bit [microseconds]
+    uint16_t _u16PostDelay;                                      ///< delay from last stop bit to driver release [microseconds]
+    MBDirectionCallback _pfnPreTransmission;                     ///< called before transmitting (0 = none)
+    MBDirectionCallback _pfnPostTransmission;                    ///< called after transmitting (0 = none)
     
-    // Modbus function codes for bit access
-    static const uint8_t ku8MBReadCoils                  = 0x01; ///< Modbus function 0x01 Read Coils
-    static const uint8_t ku8MBReadDiscreteInputs         = 0x02; ///< Modbus function 0x02 Read Discrete Inputs
-    static const uint8_t ku8MBWriteSingleCoil            = 0x05; ///< Modbus function 0x05 Write Single Coil
-    static const uint8_t ku8MBWriteMultipleCoils         = 0x0F; ///< Modbus function 0x0F Write Multiple Coils
-
-    // Modbus function codes for 16 bit access
-    static const uint8_t ku8MBReadHoldingRegisters       = 0x03; ///< Modbus function 0x03 Read Holding Registers
-    static const uint8_t ku8MBReadInputRegisters         = 0x04; ///< Modbus function 0x04 Read Input Registers
-    static const uint8_t ku8MBWriteSingleRegister        = 0x06; ///< Modbus function 0x06 Write Single Register
-    static const uint8_t ku8MBWriteMultipleRegisters     = 0x10; ///< Modbus function 0x10 Write Multiple Registers
-    static const uint8_t ku8MBMaskWriteRegister          = 0x16; ///< Modbus function 0x16 Mask Write Register
-    static const uint8_t ku8MBReadWriteMultipleRegisters = 0x17; ///< Modbus function 0x17 Read Write Multiple Registers
+    // Modbus encapsulated interface/file record constants
+    static const uint8_t ku8MBFileReferenceType          = 0x06; ///< file record sub-request reference type
+    static const uint8_t ku8MBMaxFileRecordQty           = 121;  ///< registers per file record sub-request (response data length <= 0xF5)
+    static const uint8_t ku8MBFileChunkQty               = (ku16MaxADUSize - 12) / 2 < ku8MBMaxFileRecordQty ?
+      (ku16MaxADUSize - 12) / 2 : ku8MBMaxFileRecordQty;         ///< registers per readFile()/writeFile() chunk (request and response fit the frame buffer)
+    static const uint16_t ku16MBMaxReadBits              = 2000; ///< coils/discrete inputs per read request
+    static const uint16_t ku16MBMaxWriteCoils            = 1968; ///< coils per Write Multiple Coils request
+    static const uint8_t ku8MBMaxFusedReadQty            = 125;  ///< registers read per Read/Write Multiple Registers request
+    static const uint8_t ku8MBMaxFusedWriteQty           = 121;  ///< registers written per Read/Write Multiple Registers request
     
     // Modbus timeout [milliseconds]
     static const uint8_t ku8MBResponseTimeout            = 200;  ///< Modbus timeout [milliseconds]
+    static const uint8_t ku8MBScanTurnaround             = 10;   ///< minimum slave turnaround allowed during discoverSlaves() [milliseconds]
+    static const uint8_t ku8MBLinkProbes                 = 20;   ///< probes per slave measuring a setting during negotiateLink()
+    static const uint8_t ku8MBLinkSettleTime             = 100;  ///< time allowed for slaves to change settings [milliseconds]
+    static const uint16_t ku16MBTurnaroundBudget         = 2000; ///< slave turnaround allowed per request by the cyclic scan plan [microseconds]
+    
+    // Slave health tracking
+    static const uint8_t ku8MBErrorRateShift             = 4;    ///< error rate moving average weight (1/2^n per transaction)
+    static const uint8_t ku8MBDegradedReadQty            = 16;   ///< registers per read request sent to a degraded slave
+    static const uint8_t ku8MBDegradedScanDivider        = 4;    ///< cyclic scan polls a degraded slave every nth cycle
+    
+    void     idle();
+    void     setTimeout(uint32_t);
+#if __MODBUSMASTER_READ_HOLDING_REGISTERS__ && __MODBUSMASTER_WRITE_SINGLE_REGISTER__
+    void     setLink(const ModbusLinkSetting *);
+    uint8_t  probeLink(const uint8_t *, const ModbusBaudProfile * const *, uint8_t, 
+      uint8_t, ModbusLinkQuality *);
+    uint8_t  canSwitchLink(const ModbusBaudProfile * const *, uint8_t, 
+      const ModbusLinkSetting *, uint8_t, uint8_t);
+    void     switchLink(const uint8_t *, const ModbusBaudProfile * const *, uint8_t, 
+      const ModbusLinkSetting *, uint8_t);
+#endif
+    void     load(ModbusRequest *);
+    uint16_t writeWords(ModbusRequest *);
+    uint16_t writeWords(uint8_t, uint16_t);
+    void     prepareNext();
+    ModbusRequest **selectRequest();
+    ModbusRequest *dequeue(uint8_t);
+    void     dispatch(ModbusRequest *);
+    void     complete(ModbusRequest *);
+#if __MODBUSMASTER_READ_WRITE_MULTIPLE_REGISTERS__
+    ModbusRequest *fusible(ModbusRequest *);
+    uint8_t  fuse(ModbusRequest *, ModbusRequest *);
+#endif
+    uint8_t  supported(uint8_t);
+    void     serviceUrgent();
+    uint8_t  assembleADU(uint8_t [], uint8_t);
+    void     beginTransmission();
+    void     endTransmission();
+#if __MODBUSMASTER_CAPTURE__
+    void     capture(uint8_t, uint8_t, uint32_t, uint8_t *, uint8_t);
+    uint8_t  captureByte(uint16_t);
+#endif
+#if __MODBUSMASTER_HEALTH__
+    void     record(uint8_t, uint8_t, const uint8_t *, uint8_t);
+    ModbusSlaveHealth *health(uint8_t);
+#endif
+    uint16_t requestSize(ModbusRequest *);
+    uint16_t requestSize(uint8_t, uint16_t);
+    uint16_t responseSize(ModbusRequest *);
     
     // master function that conducts Modbus transactions
     uint8_t ModbusMasterTransaction(uint8_t u8MBFunction);
 };
+
+
+/**
+Lightweight handle for one slave on a shared bus.
+
+Any number of nodes can share one ModbusMaster, which owns the serial 
+port, the frame buffers and the request queue. A node only stores the 
+slave ID and its place in the bus's round-robin, so slaves no longer 
+cost a full ModbusMaster (two 64-word buffers) each, and requests from 
+different nodes can never interleave on the line.
+
+@ingroup queue
+*/
+class ModbusNode
+{
+  public:
+    ModbusNode(ModbusMaster &, uint8_t);
+    
+    uint8_t  submit(ModbusRequest *);
+    uint8_t  execute(ModbusRequest *);
+    void     setFusion(uint8_t);
+    uint8_t  getFusion();
+    
+  private:
+    ModbusMaster *_pBus;                                         ///< bus the node's slave is attached to
+    uint8_t  _u8MBSlave;                                         ///< Modbus slave (1..255) initialized in constructor
+    uint16_t _u16LastServed;                                     ///< bus service sequence number when last served
+    uint8_t  _u8Fusion;                                          ///< fuse queued writes and reads into function 0x17 (cleared if the slave lacks it)
+    
+    friend class ModbusMaster;
+};
 #endif
 
 /**
 @example examples/Basic/Basic.pde
 @example examples/PhoenixContact_nanoLC/PhoenixContact_nanoLC.pde
+@example examples/SharedBus/SharedBus.pde
+@example examples/Negotiate/Negotiate.pde
+@example examples/Slave/Slave.pde
+@example examples/Gateway/Gateway.pde
 */
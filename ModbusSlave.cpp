@@ -0,0 +1,943 @@
+/**
+@file
+Modbus RTU slave engine sharing the ModbusMaster frame codec.
+*/
+/*
+
+  ModbusSlave.cpp - Modbus RTU slave engine sharing the ModbusMaster
+  frame codec.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+#include "ModbusSlave.h"
+
+
+/* _____PUBLIC FUNCTIONS_____________________________________________________ */
+/**
+Constructor.
+
+Creates class object using Modbus slave ID 1.
+
+@ingroup slave
+*/
+ModbusSlave::ModbusSlave()
+{
+  _u8MBSlave = 1;
+#ifdef ARDUINO
+  _pSerial = 0;
+#endif
+  _u32FrameGap = 1750;
+  _u32LastByte = 0;
+  _u16ADUSize = 0;
+  _pfnPreTransmission = 0;
+  _pfnPostTransmission = 0;
+  _pu16Holding = 0;
+  _u16HoldingBase = 0;
+  _u16HoldingQty = 0;
+  _pu16Input = 0;
+  _u16InputBase = 0;
+  _u16InputQty = 0;
+  _pCoils = 0;
+  _u16CoilBase = 0;
+  _pDiscreteInputs = 0;
+  _u16DiscreteInputBase = 0;
+  _pfnRegister = 0;
+  _pszDeviceId[0] = _pszDeviceId[1] = _pszDeviceId[2] = 0;
+  _u16BusMessageCount = 0;
+  _u16BusCommErrorCount = 0;
+  _u16BusExceptionCount = 0;
+  _u16SlaveMessageCount = 0;
+  _u16SlaveNoRespCount = 0;
+}
+
+
+/**
+Constructor.
+
+Creates class object using specified Modbus slave ID.
+
+@param u8MBSlave Modbus slave ID (1..247)
+@ingroup slave
+*/
+ModbusSlave::ModbusSlave(uint8_t u8MBSlave)
+{
+  _u8MBSlave = u8MBSlave;
+#ifdef ARDUINO
+  _pSerial = 0;
+#endif
+  _u32FrameGap = 1750;
+  _u32LastByte = 0;
+  _u16ADUSize = 0;
+  _pfnPreTransmission = 0;
+  _pfnPostTransmission = 0;
+  _pu16Holding = 0;
+  _u16HoldingBase = 0;
+  _u16HoldingQty = 0;
+  _pu16Input = 0;
+  _u16InputBase = 0;
+  _u16InputQty = 0;
+  _pCoils = 0;
+  _u16CoilBase = 0;
+  _pDiscreteInputs = 0;
+  _u16DiscreteInputBase = 0;
+  _pfnRegister = 0;
+  _pszDeviceId[0] = _pszDeviceId[1] = _pszDeviceId[2] = 0;
+  _u16BusMessageCount = 0;
+  _u16BusCommErrorCount = 0;
+  _u16BusExceptionCount = 0;
+  _u16SlaveMessageCount = 0;
+  _u16SlaveNoRespCount = 0;
+}
+
+
+#ifdef ARDUINO
+/**
+Attach the serial port served by poll().
+
+The port must already be initialized (e.g. Serial1.begin(19200)); the
+baud rate is used to detect the silent interval (t3.5) that ends a
+request frame.
+
+@param serial serial port
+@param u32BaudRate baud rate the port was initialized with
+@ingroup slave
+*/
+void ModbusSlave::begin(Stream &serial, uint32_t u32BaudRate)
+{
+  _pSerial = &serial;
+  _u32FrameGap = (u32BaudRate && u32BaudRate <= 19200) ?
+    38500000UL / u32BaudRate : 1750;
+  _u16ADUSize = 0;
+}
+#endif
+
+
+/**
+Set callbacks driving an RS-485 transceiver around each response sent
+by poll().
+
+@param pfnPreTransmission called before the response is written (0 = none)
+@param pfnPostTransmission called once the response has been sent (0 = none)
+@ingroup slave
+*/
+void ModbusSlave::setDirectionCallbacks(MBDirectionCallback pfnPreTransmission,
+  MBDirectionCallback pfnPostTransmission)
+{
+  _pfnPreTransmission = pfnPreTransmission;
+  _pfnPostTransmission = pfnPostTransmission;
+}
+
+
+/**
+Map a holding register table.
+
+@param pu16Registers register storage (0 = none)
+@param u16BaseAddress address of pu16Registers[0]
+@param u16Qty quantity of registers in pu16Registers
+@ingroup slave
+*/
+void ModbusSlave::setHoldingRegisters(uint16_t *pu16Registers,
+  uint16_t u16BaseAddress, uint16_t u16Qty)
+{
+  _pu16Holding = pu16Registers;
+  _u16HoldingBase = u16BaseAddress;
+  _u16HoldingQty = u16Qty;
+}
+
+
+/**
+Map an input register table.
+
+@param pu16Registers register storage (0 = none)
+@param u16BaseAddress address of pu16Registers[0]
+@param u16Qty quantity of registers in pu16Registers
+@ingroup slave
+*/
+void ModbusSlave::setInputRegisters(uint16_t *pu16Registers,
+  uint16_t u16BaseAddress, uint16_t u16Qty)
+{
+  _pu16Input = pu16Registers;
+  _u16InputBase = u16BaseAddress;
+  _u16InputQty = u16Qty;
+}
+
+
+/**
+Map a coil table.
+
+@param bsCoils coils; bit 0 is the coil at u16BaseAddress
+@param u16BaseAddress address of the first coil
+@ingroup slave
+*/
+void ModbusSlave::setCoils(ModbusBitSet &bsCoils, uint16_t u16BaseAddress)
+{
+  _pCoils = &bsCoils;
+  _u16CoilBase = u16BaseAddress;
+}
+
+
+/**
+Map a discrete input table.
+
+@param bsInputs discrete inputs; bit 0 is the input at u16BaseAddress
+@param u16BaseAddress address of the first discrete input
+@ingroup slave
+*/
+void ModbusSlave::setDiscreteInputs(ModbusBitSet &bsInputs,
+  uint16_t u16BaseAddress)
+{
+  _pDiscreteInputs = &bsInputs;
+  _u16DiscreteInputBase = u16BaseAddress;
+}
+
+
+/**
+Set the callback serving holding/input registers outside the tables.
+
+Register ranges that are not entirely inside a table are handled one
+register at a time: table registers directly, all others through the
+callback. Without a callback such ranges are answered with
+ModbusCodec::ku8MBIllegalDataAddress.
+
+@param pfnRegister callback (0 = none)
+@ingroup slave
+*/
+void ModbusSlave::setRegisterCallback(MBRegisterCallback pfnRegister)
+{
+  _pfnRegister = pfnRegister;
+}
+
+
+/**
+Set the basic device identification objects returned by Modbus function
+0x2B/0x0E Read Device Identification.
+
+Strings are referenced, not copied.
+
+@param szVendorName object 0x00 VendorName
+@param szProductCode object 0x01 ProductCode
+@param szRevision object 0x02 MajorMinorRevision
+@ingroup slave
+*/
+void ModbusSlave::setDeviceIdentification(const char *szVendorName,
+  const char *szProductCode, const char *szRevision)
+{
+  _pszDeviceId[0] = szVendorName;
+  _pszDeviceId[1] = szProductCode;
+  _pszDeviceId[2] = szRevision;
+}
+
+
+/**
+Process one request frame.
+
+Checks the CRC and slave ID, executes the request against the tables
+and builds the response frame, CRC included. Requests to other slaves,
+damaged frames and broadcasts (slave ID 0) produce no response.
+
+Every request field is read before the response is written, so
+pu8Response may point to pu8Request to process a frame in place.
+pu8Response must hold 255 bytes.
+
+Supported functions: 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x0F, 0x10,
+0x16, 0x17, 0x18 (FIFO count register followed by the queued registers,
+in the holding register space), 0x08 sub-functions 0x0000 and
+0x000A..0x000F, and 0x2B/0x0E basic device identification.
+
+@param pu8Request request frame, slave ID through CRC
+@param u8Size size of the request frame [bytes]
+@param pu8Response destination of the response frame
+@return size of the response frame (0 = no response) [bytes]
+@ingroup slave
+*/
+uint8_t ModbusSlave::process(const uint8_t *pu8Request, uint8_t u8Size,
+  uint8_t *pu8Response)
+{
+  uint8_t u8MBSlave, u8MBFunction, u8MBStatus, u8ResponseSize, i;
+  uint16_t u16CRC, u16Address, u16Qty, u16WriteAddress, u16WriteQty, u16Value;
+  uint16_t u16AndMask, u16OrMask;
+  uint8_t u8Value[2];
+  
+  // silently discard damaged frames
+  if (u8Size < 4)
+  {
+    _u16BusCommErrorCount++;
+    return 0;
+  }
+  u16CRC = ModbusCodec::calculateCRC(pu8Request, u8Size - 2);
+  if (lowByte(u16CRC) != pu8Request[u8Size - 2] ||
+    highByte(u16CRC) != pu8Request[u8Size - 1])
+  {
+    _u16BusCommErrorCount++;
+    return 0;
+  }
+  _u16BusMessageCount++;
+  
+  u8MBSlave = pu8Request[0];
+  if (u8MBSlave && u8MBSlave != _u8MBSlave)
+  {
+    return 0;
+  }
+  _u16SlaveMessageCount++;
+  
+  u8MBFunction = pu8Request[1];
+  u16Address = (u8Size >= 6) ? word(pu8Request[2], pu8Request[3]) : 0;
+  u16Qty = (u8Size >= 8) ? word(pu8Request[4], pu8Request[5]) : 0;
+  u8MBStatus = ModbusCodec::ku8MBSuccess;
+  u8ResponseSize = 2;
+  
+  switch(u8MBFunction)
+  {
+    case ModbusCodec::ku8MBReadCoils:
+    case ModbusCodec::ku8MBReadDiscreteInputs:
+      if (u8Size != 8 || !u16Qty || u16Qty > ku16MBMaxReadBits)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8MBStatus = readBits((u8MBFunction == ModbusCodec::ku8MBReadCoils) ?
+        _pCoils : _pDiscreteInputs, (u8MBFunction == ModbusCodec::ku8MBReadCoils) ?
+        _u16CoilBase : _u16DiscreteInputBase, u16Address, u16Qty, &pu8Response[3]);
+      pu8Response[u8ResponseSize++] = (u16Qty + 7) >> 3;
+      u8ResponseSize += (u16Qty + 7) >> 3;
+      break;
+    
+    case ModbusCodec::ku8MBReadHoldingRegisters:
+    case ModbusCodec::ku8MBReadInputRegisters:
+      if (u8Size != 8 || !u16Qty || u16Qty > ku8MBMaxReadRegisters)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8MBStatus = readRegisters(u8MBFunction, u16Address, u16Qty, &pu8Response[3]);
+      pu8Response[u8ResponseSize++] = u16Qty << 1;
+      u8ResponseSize += u16Qty << 1;
+      break;
+    
+    case ModbusCodec::ku8MBWriteSingleCoil:
+      if (u8Size != 8 || (u16Qty != 0x0000 && u16Qty != 0xFF00))
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8Value[0] = u16Qty ? 1 : 0;
+      u8MBStatus = writeBits(u16Address, 1, u8Value);
+      u8ResponseSize = 6;
+      break;
+    
+    case ModbusCodec::ku8MBWriteSingleRegister:
+      if (u8Size != 8)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8MBStatus = writeRegisters(u16Address, 1, &pu8Request[4]);
+      u8ResponseSize = 6;
+      break;
+    
+    case ModbusCodec::ku8MBWriteMultipleCoils:
+      if (u8Size < 9 || !u16Qty || u16Qty > ku16MBMaxWriteBits ||
+        pu8Request[6] != ((u16Qty + 7) >> 3) || u8Size != pu8Request[6] + 9)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8MBStatus = writeBits(u16Address, u16Qty, &pu8Request[7]);
+      u8ResponseSize = 6;
+      break;
+    
+    case ModbusCodec::ku8MBWriteMultipleRegisters:
+      if (u8Size < 9 || !u16Qty || u16Qty > ku8MBMaxWriteRegisters ||
+        pu8Request[6] != (u16Qty << 1) || u8Size != pu8Request[6] + 9)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8MBStatus = writeRegisters(u16Address, u16Qty, &pu8Request[7]);
+      u8ResponseSize = 6;
+      break;
+    
+    case ModbusCodec::ku8MBMaskWriteRegister:
+      if (u8Size != 10)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u16AndMask = word(pu8Request[4], pu8Request[5]);
+      u16OrMask = word(pu8Request[6], pu8Request[7]);
+      u8MBStatus = readRegisters(ModbusCodec::ku8MBReadHoldingRegisters,
+        u16Address, 1, u8Value);
+      if (!u8MBStatus)
+      {
+        u16Value = (word(u8Value[0], u8Value[1]) & u16AndMask) |
+          (u16OrMask & ~u16AndMask);
+        u8Value[0] = highByte(u16Value);
+        u8Value[1] = lowByte(u16Value);
+        u8MBStatus = writeRegisters(u16Address, 1, u8Value);
+      }
+      u8ResponseSize = 8;
+      break;
+    
+    case ModbusCodec::ku8MBReadWriteMultipleRegisters:
+      if (u8Size < 13)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u16WriteAddress = word(pu8Request[6], pu8Request[7]);
+      u16WriteQty = word(pu8Request[8], pu8Request[9]);
+      if (!u16Qty || u16Qty > ku8MBMaxReadRegisters || !u16WriteQty ||
+        u16WriteQty > ku8MBMaxReadWriteRegisters ||
+        pu8Request[10] != (u16WriteQty << 1) || u8Size != pu8Request[10] + 13)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      // write is performed before the read
+      u8MBStatus = writeRegisters(u16WriteAddress, u16WriteQty, &pu8Request[11]);
+      if (!u8MBStatus)
+      {
+        u8MBStatus = readRegisters(ModbusCodec::ku8MBReadHoldingRegisters,
+          u16Address, u16Qty, &pu8Response[3]);
+      }
+      pu8Response[u8ResponseSize++] = u16Qty << 1;
+      u8ResponseSize += u16Qty << 1;
+      break;
+    
+    case ModbusCodec::ku8MBReadFifoQueue:
+      if (u8Size != 6)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8MBStatus = readRegisters(ModbusCodec::ku8MBReadHoldingRegisters,
+        u16Address, 1, u8Value);
+      if (u8MBStatus)
+      {
+        break;
+      }
+      u16Qty = word(u8Value[0], u8Value[1]);
+      if (u16Qty > ku8MBMaxFifoCount)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      if (u16Qty)
+      {
+        u8MBStatus = readRegisters(ModbusCodec::ku8MBReadHoldingRegisters,
+          u16Address + 1, u16Qty, &pu8Response[6]);
+      }
+      pu8Response[u8ResponseSize++] = 0;
+      pu8Response[u8ResponseSize++] = (u16Qty << 1) + 2;
+      pu8Response[u8ResponseSize++] = 0;
+      pu8Response[u8ResponseSize++] = u16Qty;
+      u8ResponseSize += u16Qty << 1;
+      break;
+    
+    case ModbusCodec::ku8MBDiagnostics:
+      if (u8Size < 6)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      switch(u16Address)
+      {
+        case ModbusCodec::ku16MBReturnQueryData:
+          // loop back the whole data field
+          for (i = 2; i < u8Size - 2; i++)
+          {
+            pu8Response[i] = pu8Request[i];
+          }
+          u8ResponseSize = u8Size - 2;
+          break;
+        
+        case ModbusCodec::ku16MBClearCounters:
+        case ModbusCodec::ku16MBReturnBusMessageCount:
+        case ModbusCodec::ku16MBReturnBusCommErrorCount:
+        case ModbusCodec::ku16MBReturnBusExceptionCount:
+        case ModbusCodec::ku16MBReturnSlaveMessageCount:
+        case ModbusCodec::ku16MBReturnSlaveNoRespCount:
+          if (u8Size != 8)
+          {
+            u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+            break;
+          }
+          if (u16Address == ModbusCodec::ku16MBClearCounters)
+          {
+            _u16BusMessageCount = 0;
+            _u16BusCommErrorCount = 0;
+            _u16BusExceptionCount = 0;
+            _u16SlaveMessageCount = 0;
+            _u16SlaveNoRespCount = 0;
+          }
+          u16Value = getDiagnosticCounter(u16Address);
+          pu8Response[u8ResponseSize++] = highByte(u16Address);
+          pu8Response[u8ResponseSize++] = lowByte(u16Address);
+          pu8Response[u8ResponseSize++] = highByte(u16Value);
+          pu8Response[u8ResponseSize++] = lowByte(u16Value);
+          break;
+        
+        default:
+          u8MBStatus = ModbusCodec::ku8MBIllegalFunction;
+          break;
+      }
+      break;
+    
+    case ModbusCodec::ku8MBEncapsulatedInterface:
+      if (u8Size < 3 || pu8Request[2] != ModbusCodec::ku8MBReadDeviceIdentification)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalFunction;
+        break;
+      }
+      if (u8Size != 7)
+      {
+        u8MBStatus = ModbusCodec::ku8MBIllegalDataValue;
+        break;
+      }
+      u8ResponseSize = readDeviceIdentification(pu8Request[3], pu8Request[4],
+        pu8Response);
+      if (u8ResponseSize < 8)
+      {
+        u8MBStatus = u8ResponseSize;
+        u8ResponseSize = 2;
+      }
+      break;
+    
+    default:
+      u8MBStatus = ModbusCodec::ku8MBIllegalFunction;
+      break;
+  }
+  
+  // broadcasts are never answered
+  if (!u8MBSlave)
+  {
+    _u16SlaveNoRespCount++;
+    return 0;
+  }
+  
+  pu8Response[0] = u8MBSlave;
+  pu8Response[1] = u8MBFunction;
+  if (u8MBStatus)
+  {
+    _u16BusExceptionCount++;
+    pu8Response[1] |= 0x80;
+    pu8Response[2] = u8MBStatus;
+    u8ResponseSize = 3;
+  }
+  else
+  {
+    switch(u8MBFunction)
+    {
+      case ModbusCodec::ku8MBWriteSingleCoil:
+      case ModbusCodec::ku8MBWriteSingleRegister:
+      case ModbusCodec::ku8MBWriteMultipleCoils:
+      case ModbusCodec::ku8MBWriteMultipleRegisters:
+      case ModbusCodec::ku8MBMaskWriteRegister:
+        // writes echo the request header
+        for (i = 2; i < u8ResponseSize; i++)
+        {
+          pu8Response[i] = pu8Request[i];
+        }
+        break;
+    }
+  }
+  
+  u16CRC = ModbusCodec::calculateCRC(pu8Response, u8ResponseSize);
+  pu8Response[u8ResponseSize++] = lowByte(u16CRC);
+  pu8Response[u8ResponseSize++] = highByte(u16CRC);
+  return u8ResponseSize;
+}
+
+
+#ifdef ARDUINO
+/**
+Receive and answer requests on the serial port attached by begin().
+
+Collects request bytes until the line has been silent for t3.5, then
+processes the frame and writes the response. Call as often as possible
+from loop().
+
+@return size of the response sent (0 = none) [bytes]
+@ingroup slave
+*/
+uint8_t ModbusSlave::poll()
+{
+  uint8_t u8ResponseSize;
+  
+  if (!_pSerial)
+  {
+    return 0;
+  }
+  
+  while (_pSerial->available())
+  {
+    // keep counting past the buffer so an oversized frame is discarded
+    if (_u16ADUSize < sizeof(_u8ADU))
+    {
+      _u8ADU[_u16ADUSize] = _pSerial->read();
+    }
+    else
+    {
+      _pSerial->read();
+    }
+    if (_u16ADUSize <= sizeof(_u8ADU))
+    {
+      _u16ADUSize++;
+    }
+    _u32LastByte = micros();
+  }
+  
+  if (!_u16ADUSize || micros() - _u32LastByte < _u32FrameGap)
+  {
+    return 0;
+  }
+  
+  if (_u16ADUSize > 255)
+  {
+    _u16BusCommErrorCount++;
+    u8ResponseSize = 0;
+  }
+  else
+  {
+    u8ResponseSize = process(_u8ADU, _u16ADUSize, _u8ADU);
+  }
+  _u16ADUSize = 0;
+  
+  if (u8ResponseSize)
+  {
+    if (_pfnPreTransmission)
+    {
+      _pfnPreTransmission();
+    }
+    _pSerial->write(_u8ADU, u8ResponseSize);
+    _pSerial->flush();
+    if (_pfnPostTransmission)
+    {
+      _pfnPostTransmission();
+    }
+  }
+  return u8ResponseSize;
+}
+#endif
+
+
+/**
+Retrieve a diagnostic counter, as returned by Modbus function 0x08.
+
+@param u16SubFunction ModbusCodec::ku16MBReturnBusMessageCount..ModbusCodec::ku16MBReturnSlaveNoRespCount
+@return counter value (0 for other sub-functions)
+@ingroup slave
+*/
+uint16_t ModbusSlave::getDiagnosticCounter(uint16_t u16SubFunction)
+{
+  switch(u16SubFunction)
+  {
+    case ModbusCodec::ku16MBReturnBusMessageCount:
+      return _u16BusMessageCount;
+    
+    case ModbusCodec::ku16MBReturnBusCommErrorCount:
+      return _u16BusCommErrorCount;
+    
+    case ModbusCodec::ku16MBReturnBusExceptionCount:
+      return _u16BusExceptionCount;
+    
+    case ModbusCodec::ku16MBReturnSlaveMessageCount:
+      return _u16SlaveMessageCount;
+    
+    case ModbusCodec::ku16MBReturnSlaveNoRespCount:
+      return _u16SlaveNoRespCount;
+  }
+  return 0;
+}
+
+
+/* _____PRIVATE FUNCTIONS____________________________________________________ */
+/**
+Read holding/input registers into a response frame.
+
+A range entirely inside the table is copied directly; any other range
+is served register by register from the table or the register callback.
+
+@param u8MBFunction ModbusCodec::ku8MBReadHoldingRegisters or ModbusCodec::ku8MBReadInputRegisters
+@param u16Address address of the first register
+@param u8Qty quantity of registers
+@param pu8Data destination, 2 bytes per register ordered H, L
+@return 0 on success, Modbus exception code otherwise
+*/
+uint8_t ModbusSlave::readRegisters(uint8_t u8MBFunction, uint16_t u16Address,
+  uint8_t u8Qty, uint8_t *pu8Data)
+{
+  uint16_t *pu16Table;
+  uint16_t u16Offset, u16TableQty, u16Value;
+  uint8_t i, u8MBStatus;
+  
+  if (u8MBFunction == ModbusCodec::ku8MBReadHoldingRegisters)
+  {
+    pu16Table = _pu16Holding;
+    u16Offset = u16Address - _u16HoldingBase;
+    u16TableQty = _u16HoldingQty;
+  }
+  else
+  {
+    pu16Table = _pu16Input;
+    u16Offset = u16Address - _u16InputBase;
+    u16TableQty = _u16InputQty;
+  }
+  if (!pu16Table)
+  {
+    u16TableQty = 0;
+  }
+  
+  if (u16Offset < u16TableQty && u16TableQty - u16Offset >= u8Qty)
+  {
+    for (i = 0; i < u8Qty; i++)
+    {
+      *pu8Data++ = highByte(pu16Table[u16Offset + i]);
+      *pu8Data++ = lowByte(pu16Table[u16Offset + i]);
+    }
+    return ModbusCodec::ku8MBSuccess;
+  }
+  
+  if (!_pfnRegister || (uint32_t) u16Address + u8Qty > 0x10000UL)
+  {
+    return ModbusCodec::ku8MBIllegalDataAddress;
+  }
+  for (i = 0; i < u8Qty; i++, u16Offset++)
+  {
+    if (u16Offset < u16TableQty)
+    {
+      u16Value = pu16Table[u16Offset];
+    }
+    else
+    {
+      u8MBStatus = _pfnRegister(u8MBFunction, u16Address + i, &u16Value);
+      if (u8MBStatus)
+      {
+        return u8MBStatus;
+      }
+    }
+    *pu8Data++ = highByte(u16Value);
+    *pu8Data++ = lowByte(u16Value);
+  }
+  return ModbusCodec::ku8MBSuccess;
+}
+
+
+/**
+Write holding registers from a request frame.
+
+Registers outside the table are passed to the register callback in
+address order; writing stops at the first one it rejects.
+
+@param u16Address address of the first register
+@param u8Qty quantity of registers
+@param pu8Data source, 2 bytes per register ordered H, L
+@return 0 on success, Modbus exception code otherwise
+*/
+uint8_t ModbusSlave::writeRegisters(uint16_t u16Address, uint8_t u8Qty,
+  const uint8_t *pu8Data)
+{
+  uint16_t u16Offset, u16TableQty, u16Value;
+  uint8_t i, u8MBStatus;
+  
+  u16Offset = u16Address - _u16HoldingBase;
+  u16TableQty = _pu16Holding ? _u16HoldingQty : 0;
+  
+  if (u16Offset < u16TableQty && u16TableQty - u16Offset >= u8Qty)
+  {
+    for (i = 0; i < u8Qty; i++, pu8Data += 2)
+    {
+      _pu16Holding[u16Offset + i] = word(pu8Data[0], pu8Data[1]);
+    }
+    return ModbusCodec::ku8MBSuccess;
+  }
+  
+  if (!_pfnRegister || (uint32_t) u16Address + u8Qty > 0x10000UL)
+  {
+    return ModbusCodec::ku8MBIllegalDataAddress;
+  }
+  for (i = 0; i < u8Qty; i++, u16Offset++, pu8Data += 2)
+  {
+    u16Value = word(pu8Data[0], pu8Data[1]);
+    if (u16Offset < u16TableQty)
+    {
+      _pu16Holding[u16Offset] = u16Value;
+    }
+    else
+    {
+      u8MBStatus = _pfnRegister(ModbusCodec::ku8MBWriteSingleRegister,
+        u16Address + i, &u16Value);
+      if (u8MBStatus)
+      {
+        return u8MBStatus;
+      }
+    }
+  }
+  return ModbusCodec::ku8MBSuccess;
+}
+
+
+/**
+Read coils/discrete inputs into a response frame.
+
+Ranges starting on a byte boundary of the table are copied a byte at a
+time; unused bits of the last byte are cleared.
+
+@param pBits coil or discrete input table (0 = none)
+@param u16BaseAddress address of the first bit in pBits
+@param u16Address address of the first bit to read
+@param u16Qty quantity of bits
+@param pu8Data destination, frame byte layout
+@return 0 on success, Modbus exception code otherwise
+*/
+uint8_t ModbusSlave::readBits(ModbusBitSet *pBits, uint16_t u16BaseAddress,
+  uint16_t u16Address, uint16_t u16Qty, uint8_t *pu8Data)
+{
+  uint16_t u16Offset, i;
+  uint8_t u8Bytes;
+  
+  u16Offset = u16Address - u16BaseAddress;
+  if (!pBits || u16Offset >= pBits->size() || pBits->size() - u16Offset < u16Qty)
+  {
+    return ModbusCodec::ku8MBIllegalDataAddress;
+  }
+  
+  u8Bytes = (u16Qty + 7) >> 3;
+  if (!(u16Offset & 7))
+  {
+    memcpy(pu8Data, pBits->data() + (u16Offset >> 3), u8Bytes);
+  }
+  else
+  {
+    memset(pu8Data, 0, u8Bytes);
+    for (i = 0; i < u16Qty; i++)
+    {
+      if (pBits->getBit(u16Offset + i))
+      {
+        pu8Data[i >> 3] |= 1 << (i & 7);
+      }
+    }
+  }
+  if (u16Qty & 7)
+  {
+    pu8Data[u8Bytes - 1] &= (1 << (u16Qty & 7)) - 1;
+  }
+  return ModbusCodec::ku8MBSuccess;
+}
+
+
+/**
+Write coils from a request frame.
+
+@param u16Address address of the first coil
+@param u16Qty quantity of coils
+@param pu8Data source, frame byte layout
+@return 0 on success, Modbus exception code otherwise
+*/
+uint8_t ModbusSlave::writeBits(uint16_t u16Address, uint16_t u16Qty,
+  const uint8_t *pu8Data)
+{
+  uint16_t u16Offset, i;
+  
+  u16Offset = u16Address - _u16CoilBase;
+  if (!_pCoils || u16Offset >= _pCoils->size() || _pCoils->size() - u16Offset < u16Qty)
+  {
+    return ModbusCodec::ku8MBIllegalDataAddress;
+  }
+  
+  for (i = 0; i < u16Qty; i++)
+  {
+    _pCoils->setBit(u16Offset + i, (pu8Data[i >> 3] >> (i & 7)) & 1);
+  }
+  return ModbusCodec::ku8MBSuccess;
+}
+
+
+/**
+Build a Read Device Identification response.
+
+Only the basic objects (0x00..0x02) are held; regular and extended
+stream requests return them as well. A stream that does not fit in one
+frame is continued through the "more follows" flag.
+
+@param u8ReadDevIdCode ModbusCodec::ku8MBDeviceIdBasic..ModbusCodec::ku8MBDeviceIdSpecific
+@param u8ObjectId first object to return
+@param pu8Response destination of the response frame
+@return size of the response frame without CRC [bytes], or a Modbus
+exception code (always < 8)
+*/
+uint8_t ModbusSlave::readDeviceIdentification(uint8_t u8ReadDevIdCode,
+  uint8_t u8ObjectId, uint8_t *pu8Response)
+{
+  uint8_t u8ResponseSize, u8Objects, u8Length, i;
+  const char *szObject;
+  
+  if (u8ReadDevIdCode < ModbusCodec::ku8MBDeviceIdBasic ||
+    u8ReadDevIdCode > ModbusCodec::ku8MBDeviceIdSpecific)
+  {
+    return ModbusCodec::ku8MBIllegalDataValue;
+  }
+  if (u8ObjectId > 2)
+  {
+    if (u8ReadDevIdCode == ModbusCodec::ku8MBDeviceIdSpecific)
+    {
+      return ModbusCodec::ku8MBIllegalDataAddress;
+    }
+    u8ObjectId = 0;
+  }
+  
+  pu8Response[2] = ModbusCodec::ku8MBReadDeviceIdentification;
+  pu8Response[3] = u8ReadDevIdCode;
+  pu8Response[4] = ku8MBConformityLevel;
+  pu8Response[5] = 0x00;
+  pu8Response[6] = 0x00;
+  u8ResponseSize = 8;
+  u8Objects = 0;
+  
+  for (i = u8ObjectId; i <= 2; i++)
+  {
+    szObject = _pszDeviceId[i] ? _pszDeviceId[i] : "";
+    u8Length = (strlen(szObject) < (size_t) (251 - u8ResponseSize)) ?
+      strlen(szObject) : 251 - u8ResponseSize;
+    
+    // leave the rest of the stream for the next request
+    if (u8Objects && u8ResponseSize + 2 + strlen(szObject) > 253)
+    {
+      pu8Response[5] = 0xFF;
+      pu8Response[6] = i;
+      break;
+    }
+    pu8Response[u8ResponseSize++] = i;
+    pu8Response[u8ResponseSize++] = u8Length;
+    memcpy(&pu8Response[u8ResponseSize], szObject, u8Length);
+    u8ResponseSize += u8Length;
+    u8Objects++;
+    
+    if (u8ReadDevIdCode == ModbusCodec::ku8MBDeviceIdSpecific)
+    {
+      break;
+    }
+  }
+  pu8Response[7] = u8Objects;
+  return u8ResponseSize;
+}
@@ -0,0 +1,152 @@
+/**
+@file
+Modbus RTU slave engine sharing the ModbusMaster frame codec.
+
+@defgroup slave ModbusSlave Register Tables and Request Processing
+*/
+/*
+
+  ModbusSlave.h - Modbus RTU slave engine sharing the ModbusMaster
+  frame codec.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+
+#ifndef ModbusSlave_h
+#define ModbusSlave_h
+
+
+/* _____STANDARD INCLUDES____________________________________________________ */
+#ifdef ARDUINO
+// include types & constants of Wiring core API
+#include <Arduino.h>
+#endif
+
+
+/* _____PROJECT INCLUDES_____________________________________________________ */
+// function codes, exception codes, CRC and bit sets shared with the master
+#include "ModbusCodec.h"
+
+
+/* _____TYPE DEFINITIONS_____________________________________________________ */
+/**
+Callback serving registers that are not held in a ModbusSlave table
+(virtual registers, e.g. computed on demand or backed by hardware).
+
+@param u8MBFunction ModbusCodec::ku8MBReadHoldingRegisters or
+ModbusCodec::ku8MBReadInputRegisters to read,
+ModbusCodec::ku8MBWriteSingleRegister to write
+@param u16Address register address
+@param pu16Value value read (set by the callback) or value to write
+@return 0 on success, Modbus exception code otherwise
+(ModbusCodec::ku8MBIllegalDataAddress..ModbusCodec::ku8MBSlaveDeviceFailure)
+@ingroup slave
+*/
+typedef uint8_t (*MBRegisterCallback)(uint8_t u8MBFunction, uint16_t u16Address,
+  uint16_t *pu16Value);
+
+
+/* _____CLASS DEFINITIONS____________________________________________________ */
+/**
+Modbus RTU slave.
+
+Answers the requests issued by ModbusMaster from caller-supplied tables:
+holding and input registers are plain word arrays, coils and discrete
+inputs are ModbusBitSet objects (frame byte layout), each mapped at a
+base address so a request range is checked with a single subtraction
+and comparison. Registers outside the tables are passed to an optional
+callback.
+
+process() works on a frame in memory and depends on ModbusCodec only, 
+so it also builds for the host (e.g. as an in-process test slave); 
+poll() drives it from a serial port and needs the Wiring core API.
+*/
+class ModbusSlave
+{
+  public:
+    ModbusSlave();
+    ModbusSlave(uint8_t);
+    
+#ifdef ARDUINO
+    void begin(Stream &, uint32_t);
+#endif
+    void setDirectionCallbacks(MBDirectionCallback, MBDirectionCallback);
+    
+    void setHoldingRegisters(uint16_t *, uint16_t, uint16_t);
+    void setInputRegisters(uint16_t *, uint16_t, uint16_t);
+    void setCoils(ModbusBitSet &, uint16_t);
+    void setDiscreteInputs(ModbusBitSet &, uint16_t);
+    void setRegisterCallback(MBRegisterCallback);
+    void setDeviceIdentification(const char *, const char *, const char *);
+    
+    uint8_t  process(const uint8_t *, uint8_t, uint8_t *);
+#ifdef ARDUINO
+    uint8_t  poll();
+#endif
+    uint16_t getDiagnosticCounter(uint16_t);
+    
+  private:
+    uint8_t  _u8MBSlave;                                         ///< Modbus slave (1..247) initialized in constructor
+#ifdef ARDUINO
+    Stream   *_pSerial;                                          ///< serial port polled by poll() (0 = none)
+#endif
+    uint32_t _u32FrameGap;                                       ///< silent interval ending a request frame [microseconds]
+    uint32_t _u32LastByte;                                       ///< time the last request byte was received [microseconds]
+    uint16_t _u16ADUSize;                                        ///< bytes received of the current request frame
+    uint8_t  _u8ADU[256];                                        ///< request frame, replaced in place by the response
+    MBDirectionCallback _pfnPreTransmission;                     ///< called before transmitting (0 = none)
+    MBDirectionCallback _pfnPostTransmission;                    ///< called after transmitting (0 = none)
+    
+    uint16_t *_pu16Holding;                                      ///< holding register table (0 = none)
+    uint16_t _u16HoldingBase;                                    ///< address of the first holding register
+    uint16_t _u16HoldingQty;                                     ///< quantity of holding registers
+    uint16_t *_pu16Input;                                        ///< input register table (0 = none)
+    uint16_t _u16InputBase;                                      ///< address of the first input register
+    uint16_t _u16InputQty;                                       ///< quantity of input registers
+    ModbusBitSet *_pCoils;                                       ///< coil table (0 = none)
+    uint16_t _u16CoilBase;                                       ///< address of the first coil
+    ModbusBitSet *_pDiscreteInputs;                              ///< discrete input table (0 = none)
+    uint16_t _u16DiscreteInputBase;                              ///< address of the first discrete input
+    MBRegisterCallback _pfnRegister;                             ///< serves registers outside the tables (0 = none)
+    const char *_pszDeviceId[3];                                 ///< VendorName, ProductCode, MajorMinorRevision
+    
+    uint16_t _u16BusMessageCount;                                ///< frames received with a valid CRC
+    uint16_t _u16BusCommErrorCount;                              ///< frames received with a bad CRC or size
+    uint16_t _u16BusExceptionCount;                              ///< exception responses returned
+    uint16_t _u16SlaveMessageCount;                              ///< frames addressed to this slave (or broadcast)
+    uint16_t _u16SlaveNoRespCount;                               ///< frames addressed to this slave not answered
+    
+    // Modbus request limits
+    static const uint16_t ku16MBMaxReadBits              = 2000; ///< coils/discrete inputs per read request
+    static const uint16_t ku16MBMaxWriteBits             = 1968; ///< coils per Write Multiple Coils request
+    static const uint8_t ku8MBMaxReadRegisters           = 125;  ///< registers per read request
+    static const uint8_t ku8MBMaxWriteRegisters          = 123;  ///< registers per Write Multiple Registers request
+    static const uint8_t ku8MBMaxReadWriteRegisters      = 121;  ///< registers written per Read/Write Multiple Registers request
+    static const uint8_t ku8MBMaxFifoCount               = 31;   ///< registers per Read FIFO Queue response
+    static const uint8_t ku8MBConformityLevel            = 0x81; ///< basic identification, stream and individual access
+    
+    uint8_t  readRegisters(uint8_t, uint16_t, uint8_t, uint8_t *);
+    uint8_t  writeRegisters(uint16_t, uint8_t, const uint8_t *);
+    uint8_t  readBits(ModbusBitSet *, uint16_t, uint16_t, uint16_t, uint8_t *);
+    uint8_t  writeBits(uint16_t, uint16_t, const uint8_t *);
+    uint8_t  readDeviceIdentification(uint8_t, uint8_t, uint8_t *);
+};
+#endif
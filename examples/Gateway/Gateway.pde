@@ -0,0 +1,85 @@
+/*
+
+  Gateway.pde - example using ModbusGateway to bridge Modbus TCP
+  clients to the RTU slaves on serial port 1.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+#include <SPI.h>
+#include <Ethernet.h>
+#include <ModbusGateway.h>
+
+
+// network settings
+byte mac[] = { 0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED };
+IPAddress ip(192, 168, 1, 177);
+
+// Modbus TCP listens on port 502
+EthernetServer server(502);
+EthernetClient clients[ModbusGateway::ku8MBGatewayMaxClients];
+
+// instantiate ModbusMaster object as the RTU bus, serial port 1
+ModbusMaster bus(1, 1);
+
+// gateway with (4) request/cache entries
+ModbusGateway gateway(bus);
+ModbusGatewayEntry entries[4];
+
+
+void setup()
+{
+  Ethernet.begin(mac, ip);
+  server.begin();
+  
+  // initialize Modbus communication baud rate
+  bus.begin(19200);
+  
+  // answer repeated reads from the cache for 250 ms
+  gateway.setEntries(entries, 4);
+  gateway.setCacheTime(250);
+}
+
+
+void loop()
+{
+  uint8_t i;
+  EthernetClient client = server.accept();
+  
+  // hand new connections to the gateway; refuse them when it is full
+  if (client)
+  {
+    for (i = 0; i < ModbusGateway::ku8MBGatewayMaxClients; i++)
+    {
+      if (!clients[i].connected())
+      {
+        clients[i] = client;
+        gateway.addClient(clients[i]);
+        break;
+      }
+    }
+    if (i == ModbusGateway::ku8MBGatewayMaxClients)
+    {
+      client.stop();
+    }
+  }
+  
+  gateway.poll();
+}
@@ -0,0 +1,88 @@
+/*
+
+  Negotiate.pde - example using ModbusMaster to move a bus of two
+  slaves to the fastest serial setting they handle reliably.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+#include <ModbusMaster.h>
+
+
+// instantiate ModbusMaster object on serial port 1
+ModbusMaster bus(1, 1);
+
+// candidate settings; the slaves are expected at one of them
+const ModbusLinkSetting settings[] =
+{
+  {   9600, SERIAL_8N1 },
+  {  19200, SERIAL_8N1 },
+  {  38400, SERIAL_8N1 },
+  {  57600, SERIAL_8N1 },
+  { 115200, SERIAL_8N1 },
+};
+
+// vendor profile: register 0x0100 selects the baud rate (codes 0..4 for
+// the candidates above), register 0x0110 = 0xA5 stores and applies it
+const uint16_t u16BaudCodes[] = { 0, 1, 2, 3, 4 };
+const ModbusBaudProfile profile =
+{
+  0x0100, u16BaudCodes, 0xFFFF, 0, 0x0110, 0xA5
+};
+
+uint8_t u8Slaves[] = { 2, 3 };
+const ModbusBaudProfile *pProfiles[] = { &profile, &profile };
+ModbusLinkQuality quality[5];
+
+
+void setup()
+{
+  uint8_t i, u8Setting;
+  
+  Serial.begin(9600);
+  bus.begin(19200);
+  
+  u8Setting = bus.negotiateLink(u8Slaves, pProfiles, 2, settings, 5, quality);
+  if (u8Setting == ModbusMaster::ku8MBLinkNotFound)
+  {
+    Serial.println("slaves not found");
+    return;
+  }
+  
+  for (i = 0; i < 5; i++)
+  {
+    if (quality[i].u16Probes)
+    {
+      Serial.print(settings[i].u32BaudRate);
+      Serial.print(" baud: ");
+      Serial.print(quality[i].u16Errors);
+      Serial.print(" errors, ");
+      Serial.print(quality[i].u32Throughput);
+      Serial.println(" bytes/s");
+    }
+  }
+  Serial.print("bus now at ");
+  Serial.println(settings[u8Setting].u32BaudRate);
+}
+
+
+void loop()
+{
+}
@@ -0,0 +1,97 @@
+/*
+
+  SharedBus.pde - example using ModbusMaster library
+  to poll several slaves sharing one serial port.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+#include <ModbusMaster.h>
+
+
+// instantiate ModbusMaster object as the bus, serial port 1
+// the bus owns the port and the frame buffers for all slaves
+ModbusMaster bus(1, 1);
+
+// lightweight handles for slave IDs 1..3 on the bus
+ModbusNode node1(bus, 1);
+ModbusNode node2(bus, 2);
+ModbusNode node3(bus, 3);
+
+// data read from / written to the slaves
+uint16_t u16Temperature[3][4];
+uint16_t u16Setpoint[2];
+
+// request descriptors; each stays queued until poll() completes it
+ModbusRequest readTemperature[3];
+ModbusRequest writeSetpoint;
+
+
+// re-queue a polling request as soon as it completes
+void requeue(ModbusRequest *pRequest)
+{
+  pRequest->pNode->submit(pRequest);
+}
+
+
+void setup()
+{
+  uint8_t i;
+  ModbusNode *pNode[3] = { &node1, &node2, &node3 };
+
+  // initialize Modbus communication baud rate
+  bus.begin(115200);
+
+  // read (4) 16-bit registers starting at register 0 from every slave
+  for (i = 0; i < 3; i++)
+  {
+    readTemperature[i].u8MBFunction = ModbusMaster::ku8MBReadHoldingRegisters;
+    readTemperature[i].u16ReadAddress = 0;
+    readTemperature[i].u16ReadQty = 4;
+    readTemperature[i].pu16Data = u16Temperature[i];
+    readTemperature[i].u8Priority = ModbusMaster::ku8MBPriorityLow;
+    readTemperature[i].pfnComplete = requeue;
+    pNode[i]->submit(&readTemperature[i]);
+  }
+
+  // write (2) 16-bit registers starting at register 10 of slave 2
+  writeSetpoint.u8MBFunction = ModbusMaster::ku8MBWriteMultipleRegisters;
+  writeSetpoint.u16WriteAddress = 10;
+  writeSetpoint.u16WriteQty = 2;
+  writeSetpoint.pu16Data = u16Setpoint;
+  writeSetpoint.u8Priority = ModbusMaster::ku8MBPriorityHigh;
+}
+
+
+void loop()
+{
+  static uint32_t u32LastWrite;
+
+  // once a second, queue a setpoint write ahead of the polling reads
+  if (millis() - u32LastWrite > 1000)
+  {
+    u32LastWrite = millis();
+    u16Setpoint[0]++;
+    node2.submit(&writeSetpoint);
+  }
+
+  // execute one queued transaction per pass
+  bus.poll();
+}
@@ -0,0 +1,81 @@
+/*
+
+  Slave.pde - example using ModbusSlave to answer Modbus
+  requests from a master on serial port 1.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+#include <ModbusSlave.h>
+
+
+// instantiate ModbusSlave object, Modbus slave ID 2
+ModbusSlave slave(2);
+
+// holding registers 0..15, input registers 0..7
+uint16_t u16Holding[16];
+uint16_t u16Input[8];
+
+// coils 0..31, discrete inputs 0..7
+ModbusCoils<32> coils;
+ModbusCoils<8> inputs;
+
+
+// holding register 100 reads back the uptime in seconds
+uint8_t virtualRegister(uint8_t u8MBFunction, uint16_t u16Address,
+  uint16_t *pu16Value)
+{
+  if (u8MBFunction != ModbusCodec::ku8MBReadHoldingRegisters || u16Address != 100)
+  {
+    return ModbusCodec::ku8MBIllegalDataAddress;
+  }
+  *pu16Value = millis() / 1000;
+  return 0;
+}
+
+
+void setup()
+{
+  // initialize serial port 1; the slave needs the baud rate for frame timing
+  Serial1.begin(19200);
+  slave.begin(Serial1, 19200);
+  
+  slave.setHoldingRegisters(u16Holding, 0, 16);
+  slave.setInputRegisters(u16Input, 0, 8);
+  slave.setCoils(coils, 0);
+  slave.setDiscreteInputs(inputs, 0);
+  slave.setRegisterCallback(virtualRegister);
+  slave.setDeviceIdentification("Example", "Slave", "1.0");
+}
+
+
+void loop()
+{
+  uint8_t i;
+  
+  // publish analog inputs 0..5 as input registers 0..5
+  for (i = 0; i < 6; i++)
+  {
+    u16Input[i] = analogRead(i);
+  }
+  
+  // answer any complete request
+  slave.poll();
+}
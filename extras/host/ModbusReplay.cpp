@@ -0,0 +1,244 @@
+/*
+
+  ModbusReplay.cpp - replays a bus capture written by
+  ModbusMaster::dumpCapture() against the host slave simulator.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+/*
+  Builds without the Arduino core, e.g. from this directory:
+  
+    g++ -O2 -I../.. -o ModbusReplay ModbusReplay.cpp ../../ModbusSlave.cpp \
+      ../../ModbusCodec.cpp
+  
+  Usage:
+  
+    ModbusReplay capture.pcap [baud rate]
+  
+  Packets are taken in request/response pairs, as the master records 
+  them. Each request is fed to a ModbusSlave per slave ID, mapping all 
+  65535 registers and 2000 coils/discrete inputs from address 0 with 
+  zeroed data, so only the response sizes are compared with the 
+  capture, not the data.
+  
+  The report gives, from the capture: the span, the time per 
+  transaction and the slave turnaround (response start minus the end 
+  of the request on the wire). From the replay: the wire time the same 
+  traffic needs at the baud rate (frames plus t3.5 gaps, no 
+  turnaround), the simulator's processing time, and the responses 
+  whose size differs. Comparing two captures of the same scan table 
+  before and after a change shows where the time went.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "ModbusSlave.h"
+
+
+static const uint32_t ku32MagicMicroseconds = 0xA1B2C3D4;
+static const uint32_t ku32LinkTypeUser0     = 147;
+static const uint8_t  ku8MaxSlaves          = 248;
+
+static uint16_t u16Holding[65535];
+static uint16_t u16Input[65535];
+static ModbusCoils<2000> bsCoils;
+static ModbusCoils<2000> bsInputs;
+static ModbusSlave *pSlaves[ku8MaxSlaves];
+
+
+struct ReplayPacket
+{
+  uint32_t u32Time;                  ///< capture time [microseconds]
+  uint8_t  u8Size;                   ///< frame size [bytes]
+  uint8_t  u8Data[256];              ///< frame, slave ID through CRC
+};
+
+
+static uint32_t readLE32(const uint8_t *pu8Data)
+{
+  return (uint32_t)pu8Data[0] | ((uint32_t)pu8Data[1] << 8) |
+    ((uint32_t)pu8Data[2] << 16) | ((uint32_t)pu8Data[3] << 24);
+}
+
+
+// read the next packet; 0 at the end of the file
+static uint8_t readPacket(FILE *pFile, ReplayPacket *pPacket)
+{
+  uint8_t u8Header[16];
+  uint32_t u32Length;
+  
+  if (fread(u8Header, 1, sizeof(u8Header), pFile) != sizeof(u8Header))
+  {
+    return 0;
+  }
+  u32Length = readLE32(&u8Header[8]);
+  if (u32Length > sizeof(pPacket->u8Data) ||
+    fread(pPacket->u8Data, 1, u32Length, pFile) != u32Length)
+  {
+    return 0;
+  }
+  pPacket->u32Time = readLE32(&u8Header[0]) * 1000000UL + readLE32(&u8Header[4]);
+  pPacket->u8Size = u32Length;
+  return 1;
+}
+
+
+// time a frame of u16Bytes characters occupies the line [microseconds]
+static double wireTime(uint16_t u16Bytes, uint32_t u32BaudRate)
+{
+  return u16Bytes * 11 * 1000000.0 / u32BaudRate;
+}
+
+
+static ModbusSlave *slave(uint8_t u8MBSlave)
+{
+  ModbusSlave *pSlave;
+  
+  if (!pSlaves[u8MBSlave])
+  {
+    pSlave = new ModbusSlave(u8MBSlave);
+    pSlave->setHoldingRegisters(u16Holding, 0, 65535);
+    pSlave->setInputRegisters(u16Input, 0, 65535);
+    pSlave->setCoils(bsCoils, 0);
+    pSlave->setDiscreteInputs(bsInputs, 0);
+    pSlaves[u8MBSlave] = pSlave;
+  }
+  return pSlaves[u8MBSlave];
+}
+
+
+int main(int argc, char **argv)
+{
+  FILE *pFile;
+  uint8_t u8Header[24];
+  ReplayPacket pkRequest, pkResponse;
+  uint8_t u8Response[256];
+  uint8_t u8Size;
+  uint32_t u32BaudRate = 19200;
+  uint32_t u32First = 0, u32Last = 0;
+  uint32_t u32Transactions = 0, u32Timeouts = 0, u32Mismatches = 0, u32Answered = 0;
+  uint32_t u32Functions[256] = {0};
+  double dTurnaround = 0, dTurnaroundOne, dTurnaroundMax = 0, dWire = 0, dProcess = 0;
+  double dInterFrame;
+  struct timespec tsStart, tsEnd;
+  uint16_t i;
+  
+  if (argc < 2 || !(pFile = fopen(argv[1], "rb")))
+  {
+    fprintf(stderr, "usage: %s capture.pcap [baud rate]\n", argv[0]);
+    return 2;
+  }
+  if (argc > 2)
+  {
+    u32BaudRate = strtoul(argv[2], 0, 10);
+  }
+  // t3.5, fixed at 1750 us above 19200 baud as in the master
+  dInterFrame = (u32BaudRate > 19200) ? 1750 : wireTime(35, u32BaudRate) / 10;
+  
+  if (fread(u8Header, 1, sizeof(u8Header), pFile) != sizeof(u8Header) ||
+    readLE32(&u8Header[0]) != ku32MagicMicroseconds ||
+    readLE32(&u8Header[20]) != ku32LinkTypeUser0)
+  {
+    fprintf(stderr, "%s: not a ModbusMaster capture\n", argv[1]);
+    return 2;
+  }
+  
+  while (readPacket(pFile, &pkRequest))
+  {
+    if (!readPacket(pFile, &pkResponse))
+    {
+      // capture ended between request and response
+      pkResponse.u32Time = pkRequest.u32Time;
+      pkResponse.u8Size = 0;
+    }
+    if (!u32Transactions)
+    {
+      u32First = pkRequest.u32Time;
+    }
+    u32Last = pkResponse.u8Size ? pkResponse.u32Time : pkRequest.u32Time;
+    u32Transactions++;
+    
+    if (pkRequest.u8Size < 4)
+    {
+      continue;
+    }
+    u32Functions[pkRequest.u8Data[1]]++;
+    
+    // captured turnaround: response start minus end of request on the wire
+    if (pkResponse.u8Size)
+    {
+      dTurnaroundOne = (double)(pkResponse.u32Time - pkRequest.u32Time) -
+        wireTime(pkRequest.u8Size, u32BaudRate);
+      dTurnaround += dTurnaroundOne;
+      if (!u32Answered || dTurnaroundOne > dTurnaroundMax)
+      {
+        dTurnaroundMax = dTurnaroundOne;
+      }
+      u32Answered++;
+    }
+    else
+    {
+      u32Timeouts++;
+    }
+    
+    // replay the request
+    clock_gettime(CLOCK_MONOTONIC, &tsStart);
+    u8Size = slave(pkRequest.u8Data[0])->process(pkRequest.u8Data, pkRequest.u8Size,
+      u8Response);
+    clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+    dProcess += (tsEnd.tv_sec - tsStart.tv_sec) * 1e6 + (tsEnd.tv_nsec - tsStart.tv_nsec) / 1e3;
+    dWire += wireTime(pkRequest.u8Size + u8Size, u32BaudRate) + 2 * dInterFrame;
+    
+    if (pkResponse.u8Size && u8Size != pkResponse.u8Size)
+    {
+      u32Mismatches++;
+    }
+  }
+  fclose(pFile);
+  
+  if (!u32Transactions)
+  {
+    printf("no transactions\n");
+    return 0;
+  }
+  
+  printf("transactions          %lu (%lu without response)\n",
+    (unsigned long)u32Transactions, (unsigned long)u32Timeouts);
+  printf("capture span          %.3f ms\n", (u32Last - u32First) / 1000.0);
+  printf("per transaction       %.1f us\n", (double)(u32Last - u32First) / u32Transactions);
+  if (u32Answered)
+  {
+    printf("slave turnaround      %.1f us mean, %.1f us max\n",
+      dTurnaround / u32Answered, dTurnaroundMax);
+  }
+  printf("replay wire time      %.3f ms at %lu baud\n", dWire / 1000, (unsigned long)u32BaudRate);
+  printf("simulator processing  %.1f us total\n", dProcess);
+  printf("response size differs %lu\n", (unsigned long)u32Mismatches);
+  for (i = 0; i < 256; i++)
+  {
+    if (u32Functions[i])
+    {
+      printf("function 0x%02X         %lu\n", i, (unsigned long)u32Functions[i]);
+    }
+  }
+  return 0;
+}
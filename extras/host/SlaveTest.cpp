@@ -0,0 +1,158 @@
+/*
+
+  SlaveTest.cpp - host test of ModbusSlave::process() with separate
+  request and response buffers.
+  
+  This file is part of ModbusMaster.
+  
+  ModbusMaster is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+  
+  ModbusMaster is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  
+  You should have received a copy of the GNU General Public License
+  along with ModbusMaster.  If not, see <http://www.gnu.org/licenses/>.
+  
+  Written by Doc Walker (Rx)
+  Copyright  2009, 2010 Doc Walker <dfwmountaineers at gmail dot com>
+  
+*/
+
+/*
+  Builds without the Arduino core, e.g. from this directory:
+  
+    g++ -I../.. -o SlaveTest SlaveTest.cpp ../../ModbusSlave.cpp \
+      ../../ModbusCodec.cpp && ./SlaveTest
+*/
+
+#include <stdio.h>
+#include "ModbusSlave.h"
+
+
+static uint8_t u8Failures;
+
+
+// append the CRC to a request and process it
+static uint8_t request(ModbusSlave &slave, uint8_t *pu8Request, uint8_t u8Size,
+  uint8_t *pu8Response)
+{
+  uint16_t u16CRC = ModbusCodec::calculateCRC(pu8Request, u8Size);
+  
+  pu8Request[u8Size++] = lowByte(u16CRC);
+  pu8Request[u8Size++] = highByte(u16CRC);
+  return slave.process(pu8Request, u8Size, pu8Response);
+}
+
+
+static void check(const char *szName, uint8_t u8Size, const uint8_t *pu8Response,
+  const uint8_t *pu8Expected, uint8_t u8ExpectedSize)
+{
+  uint8_t i;
+  
+  // expected frames are given without CRC
+  if (u8Size != u8ExpectedSize + 2)
+  {
+    printf("%s: response size %u, expected %u\n", szName, u8Size, u8ExpectedSize + 2);
+    u8Failures++;
+    return;
+  }
+  for (i = 0; i < u8ExpectedSize; i++)
+  {
+    if (pu8Response[i] != pu8Expected[i])
+    {
+      printf("%s: byte %u is %02X, expected %02X\n", szName, i, pu8Response[i],
+        pu8Expected[i]);
+      u8Failures++;
+      return;
+    }
+  }
+}
+
+
+int main()
+{
+  ModbusSlave slave(1);
+  ModbusCoils<40> coils;
+  uint16_t u16Holding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  uint8_t u8Request[256], u8Response[256];
+  uint8_t u8Size, i;
+  
+  for (i = 0; i < 40; i++)
+  {
+    coils.setBit(i, i % 3 == 0);
+  }
+  slave.setCoils(coils, 0);
+  slave.setHoldingRegisters(u16Holding, 0, 8);
+  
+  // Read Coils of 20 bits: 8-byte response holding data, not an echo
+  {
+    uint8_t u8Req[8] = {1, 0x01, 0x00, 0x00, 0x00, 0x14};
+    const uint8_t u8Exp[] = {1, 0x01, 0x03, 0x49, 0x92, 0x04};
+    memcpy(u8Request, u8Req, 6);
+    u8Size = request(slave, u8Request, 6, u8Response);
+    check("read coils 20", u8Size, u8Response, u8Exp, sizeof(u8Exp));
+  }
+  
+  // Read Coils of 36 bits: 10-byte response
+  {
+    uint8_t u8Req[8] = {1, 0x01, 0x00, 0x00, 0x00, 0x24};
+    const uint8_t u8Exp[] = {1, 0x01, 0x05, 0x49, 0x92, 0x24, 0x49, 0x02};
+    memcpy(u8Request, u8Req, 6);
+    u8Size = request(slave, u8Request, 6, u8Response);
+    check("read coils 36", u8Size, u8Response, u8Exp, sizeof(u8Exp));
+  }
+  
+  // empty Read FIFO Queue: 6-byte response
+  {
+    uint8_t u8Req[6] = {1, 0x18, 0x00, 0x04};
+    const uint8_t u8Exp[] = {1, 0x18, 0x00, 0x02, 0x00, 0x00};
+    memcpy(u8Request, u8Req, 4);
+    u8Size = request(slave, u8Request, 4, u8Response);
+    check("read fifo empty", u8Size, u8Response, u8Exp, sizeof(u8Exp));
+  }
+  
+  // Write Multiple Registers echoes the request header
+  {
+    uint8_t u8Req[13] = {1, 0x10, 0x00, 0x01, 0x00, 0x02, 0x04, 0x12, 0x34, 0x56, 0x78};
+    const uint8_t u8Exp[] = {1, 0x10, 0x00, 0x01, 0x00, 0x02};
+    memcpy(u8Request, u8Req, 11);
+    u8Size = request(slave, u8Request, 11, u8Response);
+    check("write multiple registers", u8Size, u8Response, u8Exp, sizeof(u8Exp));
+    if (u16Holding[1] != 0x1234 || u16Holding[2] != 0x5678)
+    {
+      printf("write multiple registers: registers not written\n");
+      u8Failures++;
+    }
+  }
+  
+  // Mask Write Register echoes the request
+  {
+    uint8_t u8Req[10] = {1, 0x16, 0x00, 0x01, 0xFF, 0x00, 0x00, 0x0F};
+    const uint8_t u8Exp[] = {1, 0x16, 0x00, 0x01, 0xFF, 0x00, 0x00, 0x0F};
+    memcpy(u8Request, u8Req, 8);
+    u8Size = request(slave, u8Request, 8, u8Response);
+    check("mask write register", u8Size, u8Response, u8Exp, sizeof(u8Exp));
+    if (u16Holding[1] != 0x120F)
+    {
+      printf("mask write register: register is %04X\n", u16Holding[1]);
+      u8Failures++;
+    }
+  }
+  
+  // Read Coils in place, as poll() does
+  {
+    uint8_t u8Req[8] = {1, 0x01, 0x00, 0x00, 0x00, 0x14};
+    const uint8_t u8Exp[] = {1, 0x01, 0x03, 0x49, 0x92, 0x04};
+    memcpy(u8Request, u8Req, 6);
+    u8Size = request(slave, u8Request, 6, u8Request);
+    check("read coils in place", u8Size, u8Request, u8Exp, sizeof(u8Exp));
+  }
+  
+  printf(u8Failures ? "FAILED\n" : "ok\n");
+  return u8Failures ? 1 : 0;
+}